@@ -10,3 +10,8 @@ RETURNS void AS 'plproxy' LANGUAGE C;
 -- language
 CREATE OR REPLACE LANGUAGE plproxy HANDLER plproxy_call_handler VALIDATOR plproxy_validator;
 
+-- open connections to all partitions ahead of traffic
+CREATE OR REPLACE FUNCTION plproxy_prewarm (cluster_name text,
+    OUT part_nr integer, OUT reused boolean, OUT connect_ms bigint)
+RETURNS SETOF record AS 'plproxy' LANGUAGE C;
+REVOKE ALL ON FUNCTION plproxy_prewarm (text) FROM PUBLIC;
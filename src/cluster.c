@@ -24,6 +24,8 @@
 
 #include "plproxy.h"
 
+#include <limits.h>
+
 #if PG_VERSION_NUM >= 160000
 #define pg_foreign_server_aclcheck(srv, role, mode) \
 	object_aclcheck(ForeignServerRelationId, srv, role, mode)
@@ -69,8 +71,17 @@ static const char *cluster_config_options[] = {
 	"statement_timeout",
 	"connection_lifetime",
 	"query_timeout",
+	"connect_timeout",
 	"disable_binary",
 	"modular_mapping",
+	"prepared_statements",
+	"stream_chunk_size",
+	"hedge_delay",
+	"hedge_percentile",
+	"replica_selection",
+	"result_memory_limit",
+	"buckets",
+	"range_bounds",
 	/* deprecated */
 	"keepalive_idle",
 	"keepalive_interval",
@@ -81,6 +92,58 @@ static const char *cluster_config_options[] = {
 extern Datum plproxy_fdw_validator(PG_FUNCTION_ARGS);
 PG_FUNCTION_INFO_V1(plproxy_fdw_validator);
 
+/*
+ * Parse timeout value into milliseconds.  Plain number
+ * means seconds, "s" and "ms" suffixes are allowed.
+ */
+bool
+plproxy_parse_timeout(const char *val, int *ms_p)
+{
+	char	   *end;
+	long		n;
+
+	errno = 0;
+	n = strtol(val, &end, 10);
+	if (end == val || errno != 0)
+		return false;
+	while (*end == ' ')
+		end++;
+
+	if (*end == '\0' || pg_strcasecmp(end, "s") == 0)
+	{
+		if (n > INT_MAX / 1000)
+			return false;
+		n *= 1000;
+	}
+	else if (pg_strcasecmp(end, "ms") != 0 || n > INT_MAX)
+		return false;
+
+	/* negative value disables timeout */
+	*ms_p = n > 0 ? n : 0;
+	return true;
+}
+
+/* parse replica_selection value */
+static bool
+parse_replica_selection(const char *val, int *sel_p)
+{
+	if (pg_strcasecmp(val, "round_robin") == 0)
+		*sel_p = REPLICA_ROUND_ROBIN;
+	else if (pg_strcasecmp(val, "least_latency") == 0)
+		*sel_p = REPLICA_LEAST_LATENCY;
+	else
+		return false;
+	return true;
+}
+
+static bool
+is_timeout_option(const char *name)
+{
+	return pg_strcasecmp(name, "query_timeout") == 0
+		|| pg_strcasecmp(name, "connect_timeout") == 0
+		|| pg_strcasecmp(name, "hedge_delay") == 0;
+}
+
 /*
  * Connection count should be non-zero and power of 2.
  */
@@ -92,6 +155,79 @@ check_valid_partcount(int n, int modular_mapping)
 	return (n > 0) && !(n & (n - 1));
 }
 
+/*
+ * Count values in range_bounds, blank string has none.
+ */
+static int
+count_range_bounds(const char *val)
+{
+	int			n = 1;
+
+	if (val[strspn(val, " \t\n\r")] == 0)
+		return 0;
+	for (; *val; val++)
+	{
+		if (*val == ',')
+			n++;
+	}
+	return n;
+}
+
+/*
+ * Parse bucket map: comma-separated partition numbers, one per bucket,
+ * "N*P" gives N buckets to partition P.  With map == NULL, only
+ * counts buckets and finds the largest partition number.
+ */
+static bool
+parse_buckets(const char *val, int *map, int *count_p, int *maxpart_p)
+{
+	const char *p = val;
+	char	   *end;
+	long		rep,
+				part;
+	int			count = 0,
+				maxpart = 0,
+				i;
+
+	while (1)
+	{
+		part = strtol(p, &end, 10);
+		if (end == p)
+			return false;
+		for (p = end; isspace((unsigned char) *p); p++) ;
+
+		rep = 1;
+		if (*p == '*')
+		{
+			rep = part;
+			part = strtol(++p, &end, 10);
+			if (end == p)
+				return false;
+			for (p = end; isspace((unsigned char) *p); p++) ;
+		}
+		if (rep < 1 || rep > PLPROXY_MAX_BUCKETS - count || part < 0 || part > INT_MAX)
+			return false;
+
+		if (map)
+		{
+			for (i = 0; i < rep; i++)
+				map[count + i] = part;
+		}
+		count += rep;
+		if (part > maxpart)
+			maxpart = part;
+
+		if (*p == 0)
+			break;
+		if (*p++ != ',')
+			return false;
+	}
+
+	*count_p = count;
+	*maxpart_p = maxpart;
+	return true;
+}
+
 static int cluster_name_cmp(uintptr_t val, struct AANode *node)
 {
 	const char *name = (const char *)val;
@@ -115,6 +251,8 @@ static void conn_free(struct AANode *node, void *arg)
 	aatree_destroy(&conn->userstate_tree);
 	if (conn->res)
 		PQclear(conn->res);
+	if (conn->result_map)
+		pfree(conn->result_map);
 	pfree(conn);
 }
 
@@ -135,6 +273,24 @@ static void state_free(struct AANode *node, void *arg)
 	pfree(state);
 }
 
+/* prepared statements are keyed on function, one statement per function */
+static int stmt_key_cmp(uintptr_t val, struct AANode *node)
+{
+	Oid			fn_oid = (Oid)val;
+	const ProxyPreparedStmt *stmt = container_of(node, ProxyPreparedStmt, node);
+
+	if (fn_oid == stmt->fn_oid)
+		return 0;
+	return fn_oid < stmt->fn_oid ? -1 : 1;
+}
+
+static void stmt_free(struct AANode *node, void *arg)
+{
+	ProxyPreparedStmt *stmt = container_of(node, ProxyPreparedStmt, node);
+
+	plproxy_free_prepared(stmt);
+}
+
 static int userinfo_cmp(uintptr_t val, struct AANode *node)
 {
 	const char *name = (const char *)val;
@@ -220,22 +376,46 @@ plproxy_cluster_plan_init(void)
 static void
 free_connlist(ProxyCluster *cluster)
 {
+	int			i;
+
 	aatree_destroy(&cluster->conn_tree);
 
+	if (cluster->replica_map)
+	{
+		for (i = 0; i < cluster->part_count; i++)
+		{
+			if (cluster->replica_map[i].conns)
+				pfree(cluster->replica_map[i].conns);
+		}
+		pfree(cluster->replica_map);
+	}
+
 	pfree(cluster->part_map);
 	pfree(cluster->active_list);
+	if (cluster->bucket_map)
+		pfree(cluster->bucket_map);
 
 	cluster->part_map = NULL;
+	cluster->bucket_map = NULL;
+	cluster->bucket_count = 0;
+	cluster->bucket_mask = 0;
+	if (cluster->range_ctx)
+		MemoryContextReset(cluster->range_ctx);
+	cluster->range_type = InvalidOid;
+	cluster->range_values = NULL;
+	cluster->range_count = 0;
+	cluster->replica_map = NULL;
+	cluster->replica_count = 0;
 	cluster->part_count = 0;
 	cluster->part_mask = 0;
 	cluster->active_count = 0;
 }
 
 /*
- * Add new database connection if it does not exists.
+ * Find database connection, create if it does not exists.
  */
-static void
-add_connection(ProxyCluster *cluster, const char *connstr, int part_num)
+static ProxyConnection *
+get_connection(ProxyCluster *cluster, const char *connstr)
 {
 	struct AANode *node;
 	ProxyConnection *conn = NULL;
@@ -256,6 +436,18 @@ add_connection(ProxyCluster *cluster, const char *connstr, int part_num)
 
 		aatree_insert(&cluster->conn_tree, (uintptr_t)connstr, &conn->node);
 	}
+	return conn;
+}
+
+/*
+ * Add new partition.
+ */
+static void
+add_connection(ProxyCluster *cluster, const char *connstr, int part_num)
+{
+	ProxyConnection *conn;
+
+	conn = get_connection(cluster, connstr);
 	if (cluster->part_map[part_num])
 		ereport(ERROR,
 			(errcode(ERRCODE_SYNTAX_ERROR),
@@ -265,6 +457,42 @@ add_connection(ProxyCluster *cluster, const char *connstr, int part_num)
 	cluster->part_map[part_num] = conn;
 }
 
+/*
+ * Add read-only replica to partition, must be called
+ * after all partitions are added.
+ */
+static void
+add_replica(ProxyCluster *cluster, const char *connstr, int part_num)
+{
+	ProxyReplicaSet *set;
+	MemoryContext old_ctx;
+
+	old_ctx = MemoryContextSwitchTo(cluster_mem);
+
+	if (!cluster->replica_map)
+		cluster->replica_map = palloc0(cluster->part_count * sizeof(ProxyReplicaSet));
+
+	set = &cluster->replica_map[part_num];
+	if (set->count == 0)
+	{
+		set->conns = palloc(2 * sizeof(ProxyConnection *));
+		set->conns[set->count++] = cluster->part_map[part_num];
+	}
+	else
+		set->conns = repalloc(set->conns, (set->count + 1) * sizeof(ProxyConnection *));
+	set->conns[set->count++] = get_connection(cluster, connstr);
+
+	/* spread backends over replicas */
+	set->next = MyProcPid % set->count;
+
+	/* prewarm may activate all connections */
+	cluster->replica_count++;
+	cluster->active_list = repalloc(cluster->active_list,
+									(cluster->part_count + cluster->replica_count) * sizeof(ProxyConnection *));
+
+	MemoryContextSwitchTo(old_ctx);
+}
+
 /*
  * Fetch cluster version.
  * Called for each execution.
@@ -299,6 +527,10 @@ get_version(ProxyFunction *func, Datum dname)
 static void
 clear_config(ProxyConfig *cf)
 {
+	if (cf->buckets)
+		pfree(cf->buckets);
+	if (cf->range_bounds)
+		pfree(cf->range_bounds);
 	memset(cf, 0, sizeof(*cf));
 }
 
@@ -312,11 +544,53 @@ set_config_key(ProxyFunction *func, ProxyConfig *cf, const char *key, const char
 	else if (pg_strcasecmp("connection_lifetime", key) == 0)
 		cf->connection_lifetime = atoi(val);
 	else if (pg_strcasecmp("query_timeout", key) == 0)
-		cf->query_timeout = atoi(val);
+	{
+		if (!plproxy_parse_timeout(val, &cf->query_timeout))
+			plproxy_error(func, "Invalid timeout value: %s=%s", key, val);
+	}
+	else if (pg_strcasecmp("connect_timeout", key) == 0)
+	{
+		if (!plproxy_parse_timeout(val, &cf->connect_timeout))
+			plproxy_error(func, "Invalid timeout value: %s=%s", key, val);
+	}
 	else if (pg_strcasecmp("disable_binary", key) == 0)
 		cf->disable_binary = atoi(val);
 	else if (pg_strcasecmp("modular_mapping", key) == 0)
 		cf->modular_mapping = atoi(val);
+	else if (pg_strcasecmp("prepared_statements", key) == 0)
+		cf->prepared_statements = atoi(val);
+	else if (pg_strcasecmp("stream_chunk_size", key) == 0)
+		cf->stream_chunk_size = atoi(val);
+	else if (pg_strcasecmp("hedge_delay", key) == 0)
+	{
+		if (!plproxy_parse_timeout(val, &cf->hedge_delay))
+			plproxy_error(func, "Invalid timeout value: %s=%s", key, val);
+	}
+	else if (pg_strcasecmp("hedge_percentile", key) == 0)
+	{
+		cf->hedge_percentile = atoi(val);
+		if (cf->hedge_percentile < 0 || cf->hedge_percentile > 100)
+			plproxy_error(func, "Invalid percentile value: %s=%s", key, val);
+	}
+	else if (pg_strcasecmp("replica_selection", key) == 0)
+	{
+		if (!parse_replica_selection(val, &cf->replica_selection))
+			plproxy_error(func, "Invalid replica selection: %s=%s", key, val);
+	}
+	else if (pg_strcasecmp("result_memory_limit", key) == 0)
+		cf->result_memory_limit = atoi(val);
+	else if (pg_strcasecmp("buckets", key) == 0)
+	{
+		if (cf->buckets)
+			pfree(cf->buckets);
+		cf->buckets = MemoryContextStrdup(cluster_mem, val);
+	}
+	else if (pg_strcasecmp("range_bounds", key) == 0)
+	{
+		if (cf->range_bounds)
+			pfree(cf->range_bounds);
+		cf->range_bounds = MemoryContextStrdup(cluster_mem, val);
+	}
 	else if (pg_strcasecmp("keepalive_idle", key) == 0
 		|| pg_strcasecmp("keepalive_interval", key) == 0
 		|| pg_strcasecmp("keepalive_count", key) == 0)
@@ -399,12 +673,146 @@ allocate_cluster_partitions(ProxyCluster *cluster, int nparts)
 	MemoryContextSwitchTo(old_ctx);
 }
 
+/*
+ * Set up bucket map from config, after partitions are loaded.
+ */
+static void
+load_buckets(ProxyFunction *func, ProxyCluster *cluster)
+{
+	ProxyConfig *cf = &cluster->config;
+	int			count,
+				maxpart;
+
+	if (!cf->buckets)
+		return;
+
+	if (!parse_buckets(cf->buckets, NULL, &count, &maxpart))
+		plproxy_error(func, "invalid bucket map");
+	if (!check_valid_partcount(count, cf->modular_mapping))
+		plproxy_error(func, "invalid bucket count");
+	if (maxpart >= cluster->part_count)
+		plproxy_error(func, "wrong partition number in buckets, must be >= 0 and < %d",
+					  cluster->part_count);
+
+	cluster->bucket_map = MemoryContextAlloc(cluster_mem, count * sizeof(int));
+	parse_buckets(cf->buckets, cluster->bucket_map, &count, &maxpart);
+	cluster->bucket_count = count;
+	cluster->bucket_mask = count - 1;
+}
+
+/*
+ * Check range_bounds against partition count.  The values themselves
+ * are decoded on first use, when key type is known.
+ */
+static void
+load_ranges(ProxyFunction *func, ProxyCluster *cluster)
+{
+	ProxyConfig *cf = &cluster->config;
+
+	if (!cf->range_bounds)
+		return;
+
+	if (count_range_bounds(cf->range_bounds) != cluster->part_count - 1)
+		plproxy_error(func, "range_bounds must have %d values, one less than partitions",
+					  cluster->part_count - 1);
+}
+
+/*
+ * Decode range_bounds for RUN ON RANGE key type.  Decoded values stay
+ * in cluster until partitions are reloaded or key type changes.
+ */
+void
+plproxy_range_prepare(ProxyFunction *func, ProxyCluster *cluster, Oid typid)
+{
+	ProxyConfig *cf = &cluster->config;
+	TypeCacheEntry *typentry;
+	MemoryContext old_ctx;
+	Oid			typinput,
+				typioparam;
+	char	   *buf,
+			   *p,
+			   *end;
+	Datum	   *values;
+	int			count,
+				n = 0,
+				i;
+
+	if (cluster->range_type == typid)
+		return;
+
+	if (!cf->range_bounds)
+		plproxy_error(func, "RUN ON RANGE needs range_bounds in cluster config");
+
+	typentry = lookup_type_cache(typid, TYPECACHE_CMP_PROC_FINFO);
+	if (!OidIsValid(typentry->cmp_proc_finfo.fn_oid))
+		plproxy_error(func, "RANGE key type has no ordering: %s",
+					  format_type_be(typid));
+	getTypeInputInfo(typid, &typinput, &typioparam);
+
+	if (!cluster->range_ctx)
+		cluster->range_ctx = AllocSetContextCreate(cluster_mem,
+												   "PL/Proxy range bounds",
+												   ALLOCSET_SMALL_SIZES);
+	cluster->range_type = InvalidOid;
+	MemoryContextReset(cluster->range_ctx);
+
+	count = count_range_bounds(cf->range_bounds);
+	if (count != cluster->part_count - 1)
+		plproxy_error(func, "range_bounds must have %d values, one less than partitions",
+					  cluster->part_count - 1);
+
+	old_ctx = MemoryContextSwitchTo(cluster->range_ctx);
+	values = palloc((count + 1) * sizeof(Datum));
+	buf = pstrdup(cf->range_bounds);
+	for (p = buf; n < count; p = end + 1)
+	{
+		end = strchr(p, ',');
+		if (end == NULL)
+			end = p + strlen(p);
+		*end = 0;
+
+		while (isspace((unsigned char) *p))
+			p++;
+		for (i = strlen(p); i > 0 && isspace((unsigned char) p[i - 1]); i--)
+			p[i - 1] = 0;
+
+		values[n++] = OidInputFunctionCall(typinput, p, typioparam, -1);
+	}
+	MemoryContextSwitchTo(old_ctx);
+
+	cluster->range_cmp = &typentry->cmp_proc_finfo;
+	cluster->range_collation = get_typcollation(typid);
+	for (i = 1; i < count; i++)
+	{
+		if (DatumGetInt32(FunctionCall2Coll(cluster->range_cmp, cluster->range_collation,
+											values[i - 1], values[i])) >= 0)
+			plproxy_error(func, "range_bounds must be in ascending order");
+	}
+
+	cluster->range_values = values;
+	cluster->range_count = count;
+	cluster->range_type = typid;
+}
+
+/*
+ * Extra columns from get_cluster_partitions() are replicas
+ * only if named so, others are ignored as before.
+ */
+static bool
+is_replica_column(TupleDesc desc, int col)
+{
+	char	   *name = SPI_fname(desc, col);
+
+	return name && strncmp(name, "replica", 7) == 0;
+}
+
 /* fetch list of parts */
 static int
 reload_parts(ProxyCluster *cluster, Datum dname, ProxyFunction *func)
 {
 	int			err,
 				i;
+	int			col;
 	char	   *connstr;
 	TupleDesc	desc;
 	HeapTuple	row;
@@ -413,7 +821,8 @@ reload_parts(ProxyCluster *cluster, Datum dname, ProxyFunction *func)
 	err = SPI_execute_plan(partlist_plan, &dname, NULL, false, 0);
 	if (err != SPI_OK_SELECT)
 		plproxy_error(func, "get_partlist: spi error");
-	if (!check_valid_partcount(SPI_processed, cluster->config.modular_mapping))
+	if (!check_valid_partcount(SPI_processed, cluster->config.modular_mapping
+							   || cluster->config.buckets))
 		plproxy_error(func, "get_partlist: invalid part count");
 
 	/* check column types */
@@ -422,6 +831,11 @@ reload_parts(ProxyCluster *cluster, Datum dname, ProxyFunction *func)
 		plproxy_error(func, "Partition config must have at least 1 columns");
 	if (SPI_gettypeid(desc, 1) != TEXTOID)
 		plproxy_error(func, "partition column 1 must be text");
+	for (col = 2; col <= desc->natts; col++)
+	{
+		if (is_replica_column(desc, col) && SPI_gettypeid(desc, col) != TEXTOID)
+			plproxy_error(func, "partition column %d must be text", col);
+	}
 
 	allocate_cluster_partitions(cluster, SPI_processed);
 
@@ -437,6 +851,24 @@ reload_parts(ProxyCluster *cluster, Datum dname, ProxyFunction *func)
 		add_connection(cluster, connstr, i);
 	}
 
+	/* replica columns, NULL if partition has fewer */
+	for (i = 0; i < SPI_processed; i++)
+	{
+		row = SPI_tuptable->vals[i];
+
+		for (col = 2; col <= desc->natts; col++)
+		{
+			if (!is_replica_column(desc, col))
+				continue;
+			connstr = SPI_getvalue(row, desc, col);
+			if (connstr != NULL)
+				add_replica(cluster, connstr, i);
+		}
+	}
+
+	load_buckets(func, cluster);
+	load_ranges(func, cluster);
+
 	return 0;
 }
 
@@ -461,6 +893,35 @@ extract_part_num(const char *partname, int *part_num)
 	return false;
 }
 
+/* extract a partition number from replica option: pN_replica, partition_N_replica_M */
+static bool
+extract_replica_part_num(const char *name, int *part_num)
+{
+	char *partition_tags[] = { "p", "partition_", NULL };
+	char **part_tag;
+	const char *start;
+	char *errptr;
+
+	for (part_tag = partition_tags; *part_tag; part_tag++)
+	{
+		if (strstr(name, *part_tag) != name)
+			continue;
+
+		start = name + strlen(*part_tag);
+		*part_num = (int) strtoul(start, &errptr, 10);
+		if (errptr == start || strncmp(errptr, "_replica", 8) != 0)
+			continue;
+
+		errptr += 8;
+		if (*errptr == '_')
+			errptr++;
+		if (strspn(errptr, "0123456789") == strlen(errptr))
+			return true;
+	}
+
+	return false;
+}
+
 /*
  * Validate single cluster option
  */
@@ -478,6 +939,32 @@ validate_cluster_option(const char *name, const char *arg)
 
 	if (*opt == NULL)
 		elog(ERROR, "Pl/Proxy: invalid server option: %s", name);
+	else if (is_timeout_option(name))
+	{
+		int			ms;
+
+		if (!plproxy_parse_timeout(arg, &ms))
+			elog(ERROR, "Pl/Proxy: invalid timeout value: %s=%s", name, arg);
+	}
+	else if (pg_strcasecmp(name, "replica_selection") == 0)
+	{
+		int			sel;
+
+		if (!parse_replica_selection(arg, &sel))
+			elog(ERROR, "Pl/Proxy: invalid replica selection: %s=%s", name, arg);
+	}
+	else if (pg_strcasecmp(name, "buckets") == 0)
+	{
+		int			count,
+					maxpart;
+
+		if (!parse_buckets(arg, NULL, &count, &maxpart))
+			elog(ERROR, "Pl/Proxy: invalid bucket map: %s=%s", name, arg);
+	}
+	else if (pg_strcasecmp(name, "range_bounds") == 0)
+	{
+		/* values are checked against key type on use */
+	}
 	else if (strspn(arg, "0123456789") != strlen(arg))
 		elog(ERROR, "Pl/Proxy: only integer options are allowed: %s=%s",
 			 name, arg);
@@ -497,6 +984,8 @@ plproxy_fdw_validator(PG_FUNCTION_ARGS)
 	int			part_count = 0, part_num;
 	unsigned char *part_set = NULL;
 	int			modular_mapping = 0;
+	const char *buckets = NULL;
+	const char *range_bounds = NULL;
 
 	/* Pre 8.4.3 databases have broken validator interface, warn the user */
 	if (catalog == InvalidOid)
@@ -543,11 +1032,19 @@ plproxy_fdw_validator(PG_FUNCTION_ARGS)
 				part_set[part_num] = 1;
 				++part_count;
 			}
+			else if (extract_replica_part_num(def->defname, &part_num))
+			{
+				/* partition number is checked below */
+			}
 			else
 			{
 				validate_cluster_option(def->defname, arg);
 				if (pg_strcasecmp(def->defname, "modular_mapping") == 0)
 					modular_mapping = atoi(arg);
+				else if (pg_strcasecmp(def->defname, "buckets") == 0)
+					buckets = arg;
+				else if (pg_strcasecmp(def->defname, "range_bounds") == 0)
+					range_bounds = arg;
 			}
 		}
 		else if (catalog == UserMappingRelationId)
@@ -577,17 +1074,42 @@ plproxy_fdw_validator(PG_FUNCTION_ARGS)
 						 errmsg("Pl/Proxy: missing partition"),
 						 errhint("missing number: %d", part_num)));
 		}
-		if (!check_valid_partcount(part_count, modular_mapping))
+		if (!check_valid_partcount(part_count, modular_mapping || buckets))
 			ereport(ERROR,
 					(errcode(ERRCODE_SYNTAX_ERROR),
 					 errmsg("Pl/Proxy: invalid number of partitions"),
 					 errhint("the number of partitions in a cluster must be power of 2 (attempted %d)", part_count)));
 
+		if (buckets)
+		{
+			int			count,
+						maxpart;
+
+			parse_buckets(buckets, NULL, &count, &maxpart);
+			if (!check_valid_partcount(count, modular_mapping))
+				ereport(ERROR,
+						(errcode(ERRCODE_SYNTAX_ERROR),
+						 errmsg("Pl/Proxy: invalid number of buckets"),
+						 errhint("the number of buckets in a cluster must be power of 2 (attempted %d)", count)));
+			if (maxpart >= part_count)
+				ereport(ERROR,
+						(errcode(ERRCODE_SYNTAX_ERROR),
+						 errmsg("Pl/Proxy: wrong partition number in buckets - %d", maxpart),
+						 errhint("the partitions number in a cluster must be >= 0 and < %d (attempted %d)", part_count, maxpart)));
+		}
+
+		if (range_bounds && count_range_bounds(range_bounds) != part_count - 1)
+			ereport(ERROR,
+					(errcode(ERRCODE_SYNTAX_ERROR),
+					 errmsg("Pl/Proxy: wrong number of range_bounds - %d", count_range_bounds(range_bounds)),
+					 errhint("range_bounds must have one value less than partitions (%d)", part_count)));
+
 		foreach(cell, options_list)
 		{
 			DefElem    *def = lfirst(cell);
 
-			if (!extract_part_num(def->defname, &part_num))
+			if (!extract_part_num(def->defname, &part_num)
+				&& !extract_replica_part_num(def->defname, &part_num))
 				continue;
 
 			if (part_num < 0 || part_num >= part_count)
@@ -762,11 +1284,16 @@ reload_sqlmed_cluster(ProxyFunction *func, ProxyCluster *cluster,
 		{
 			part_count++;
 		}
+		else if (extract_replica_part_num(def->defname, &part_num))
+		{
+			/* added after partitions */
+		}
 		else
 			set_config_key(func, &cluster->config, def->defname, strVal(def->arg));
 	}
 
-	if (!check_valid_partcount(part_count, cluster->config.modular_mapping))
+	if (!check_valid_partcount(part_count, cluster->config.modular_mapping
+							   || cluster->config.buckets))
 		plproxy_error(func, "invalid partition count");
 
 	/*
@@ -800,6 +1327,23 @@ reload_sqlmed_cluster(ProxyFunction *func, ProxyCluster *cluster,
 	}
 
 	pfree(part_ordered);
+
+	/* replicas in option order */
+	foreach(cell, foreign_server->options)
+	{
+		DefElem    *def = lfirst(cell);
+
+		if (!extract_replica_part_num(def->defname, &part_num))
+			continue;
+
+		if (part_num < 0 || part_num >= part_count)
+			plproxy_error(func, "wrong replica partition number, must be >= 0 and < %d", part_count);
+
+		add_replica(cluster, strVal(def->arg), part_num);
+	}
+
+	load_buckets(func, cluster);
+	load_ranges(func, cluster);
 }
 
 /*
@@ -1257,6 +1801,10 @@ void plproxy_activate_connection(struct ProxyConnection *conn)
 	cluster->active_list[cluster->active_count] = conn;
 	cluster->active_count++;
 
+	/* not in current wait set, values are from last execution */
+	conn->wait_pos = -1;
+	conn->wait_events = 0;
+
 	/* fill ->cur pointer */
 
 	node = aatree_search(&conn->userstate_tree, (uintptr_t)username);
@@ -1265,11 +1813,140 @@ void plproxy_activate_connection(struct ProxyConnection *conn)
 	} else {
 		cur = MemoryContextAllocZero(cluster_mem, sizeof(*cur));
 		cur->userinfo = userinfo;
+		aatree_init(&cur->stmt_tree, stmt_key_cmp, stmt_free);
 		aatree_insert(&conn->userstate_tree, (uintptr_t)username, &cur->node);
 	}
 	conn->cur = cur;
 }
 
+/* Make room for result column mapping of natts attributes */
+ProxyResultCol *
+plproxy_conn_result_map(ProxyConnection *conn, int natts)
+{
+	if (natts > conn->result_map_len)
+	{
+		if (conn->result_map)
+			pfree(conn->result_map);
+		conn->result_map = MemoryContextAlloc(cluster_mem, natts * sizeof(ProxyResultCol));
+		conn->result_map_len = natts;
+		conn->result_map_rev = 0;
+	}
+	return conn->result_map;
+}
+
+/*
+ * Remote prepared statement cache.
+ *
+ * Statements are keyed on function OID and live as long as
+ * the connection they were prepared on.  Each function has
+ * at most one statement per connection, it remembers the
+ * function version and query text it was prepared for.
+ */
+
+ProxyPreparedStmt *
+plproxy_find_prepared(ProxyConnectionState *cur, ProxyFunction *func)
+{
+	struct AANode *node;
+
+	node = aatree_search(&cur->stmt_tree, (uintptr_t)func->oid);
+	if (node)
+		return container_of(node, ProxyPreparedStmt, node);
+	return NULL;
+}
+
+/* allocate new statement, it is added to cache when remote prepare succeeds */
+ProxyPreparedStmt *
+plproxy_new_prepared(ProxyConnectionState *cur, ProxyFunction *func, const char *sql)
+{
+	ProxyPreparedStmt *stmt;
+
+	stmt = MemoryContextAllocZero(cluster_mem, sizeof(*stmt));
+	stmt->sql = MemoryContextStrdup(cluster_mem, sql);
+	stmt->fn_oid = func->oid;
+	stmt->fn_xmin = func->stamp.xmin;
+	stmt->fn_rev = func->result_rev;
+	snprintf(stmt->name, sizeof(stmt->name), "plproxy_%d", ++cur->stmt_seq);
+	return stmt;
+}
+
+void
+plproxy_add_prepared(ProxyConnectionState *cur, ProxyPreparedStmt *stmt)
+{
+	aatree_insert(&cur->stmt_tree, (uintptr_t)stmt->fn_oid, &stmt->node);
+}
+
+/* forget one statement, it is also freed */
+void
+plproxy_remove_prepared(ProxyConnectionState *cur, ProxyPreparedStmt *stmt)
+{
+	aatree_remove(&cur->stmt_tree, (uintptr_t)stmt->fn_oid);
+}
+
+/* check if statement was prepared for older function definition or other query */
+bool
+plproxy_prepared_stale(ProxyFunction *func, ProxyPreparedStmt *stmt, const char *sql)
+{
+	return stmt->fn_xmin != func->stamp.xmin
+		|| stmt->fn_rev != func->result_rev
+		|| strcmp(stmt->sql, sql) != 0;
+}
+
+static void collect_expired(struct AANode *node, void *arg)
+{
+	ProxyPreparedStmt *stmt = container_of(node, ProxyPreparedStmt, node);
+	List	  **list = arg;
+	HeapTuple	proc_tuple;
+	bool		expired = true;
+
+	proc_tuple = SearchSysCache(PROCOID, ObjectIdGetDatum(stmt->fn_oid), 0, 0, 0);
+	if (HeapTupleIsValid(proc_tuple))
+	{
+		expired = HeapTupleHeaderGetXmin(proc_tuple->t_data) != stmt->fn_xmin;
+		ReleaseSysCache(proc_tuple);
+	}
+	if (expired)
+		*list = lappend(*list, stmt);
+}
+
+/*
+ * Find statements of functions that have been dropped or
+ * redefined since they were prepared.  Caller removes them.
+ */
+List *
+plproxy_expired_prepared(ProxyConnectionState *cur)
+{
+	List	   *list = NIL;
+
+	aatree_walk(&cur->stmt_tree, AA_WALK_IN_ORDER, collect_expired, &list);
+	return list;
+}
+
+/* statement being prepared failed, forget it */
+void
+plproxy_drop_pending(ProxyConnectionState *cur)
+{
+	if (cur->stmt_pending)
+	{
+		plproxy_free_prepared(cur->stmt_pending);
+		cur->stmt_pending = NULL;
+	}
+}
+
+void
+plproxy_free_prepared(ProxyPreparedStmt *stmt)
+{
+	pfree((void *)stmt->sql);
+	pfree(stmt);
+}
+
+/* forget all statements, called when remote side drops them too */
+void
+plproxy_drop_prepared(ProxyConnectionState *cur)
+{
+	aatree_destroy(&cur->stmt_tree);
+	plproxy_drop_pending(cur);
+}
+
 /*
  * Clean old connections and results from all clusters.
  */
@@ -1335,6 +2012,10 @@ static void clean_cluster(struct AANode *n, void *arg)
 	ProxyCluster *cluster = container_of(n, ProxyCluster, node);
 	struct MaintInfo maint;
 
+	/* streaming results are being returned */
+	if (cluster->busy)
+		return;
+
 	maint.cf = &cluster->config;
 	maint.now = arg;
 
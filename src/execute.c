@@ -27,6 +27,13 @@
 #include "plproxy.h"
 
 #include <sys/time.h>
+#include <limits.h>
+
+#if PG_VERSION_NUM >= 100000
+#include "pgstat.h"
+#include "storage/latch.h"
+#define USE_WAIT_EVENT_SET
+#endif
 
 /* find poll() */
 #if defined(HAVE_POLL_H)
@@ -37,6 +44,11 @@
 #error "PL/Proxy requires poll() API"
 #endif
 
+#if PG_VERSION_NUM >= 160000
+#define pg_proc_aclcheck(fn, role, mode) \
+	object_aclcheck(ProcedureRelationId, fn, role, mode)
+#endif
+
 #if PG_VERSION_NUM >= 150000
 
 #include "common/pg_prng.h"
@@ -66,6 +78,146 @@ conn_error(ProxyFunction *func, ProxyConnection *conn, const char *desc)
 				  PQdb(conn->cur->db), desc, PQerrorMessage(conn->cur->db));
 }
 
+/*
+ * Connection state changed, its registration in wait set
+ * is updated on next poll_conns().  Without wait set
+ * nothing to do, it is built from all connections.
+ */
+static void
+wait_dirty(ProxyConnection *conn)
+{
+	ProxyCluster *cluster = conn->cluster;
+
+	if (conn->wait_dirty || !cluster->wait_set)
+		return;
+
+	if (cluster->wait_dirty_count >= cluster->wait_dirty_alloc)
+	{
+		int			n = cluster->wait_dirty_alloc ? cluster->wait_dirty_alloc * 2 : 64;
+
+		if (cluster->wait_dirty)
+			cluster->wait_dirty = repalloc(cluster->wait_dirty, n * sizeof(ProxyConnection *));
+		else
+			cluster->wait_dirty = MemoryContextAlloc(TopMemoryContext, n * sizeof(ProxyConnection *));
+		cluster->wait_dirty_alloc = n;
+	}
+	conn->wait_dirty = true;
+	cluster->wait_dirty[cluster->wait_dirty_count++] = conn;
+}
+
+/* Cancel unfinished query and drop the connection without waiting */
+static void
+abandon_conn(ProxyConnection *conn)
+{
+	PGcancel   *cancel;
+	char		errbuf[256];
+
+	wait_dirty(conn);
+	switch (conn->cur->state)
+	{
+		case C_QUERY_WRITE:
+		case C_QUERY_READ:
+			cancel = PQgetCancel(conn->cur->db);
+			if (cancel)
+			{
+				if (!PQcancel(cancel, errbuf, sizeof(errbuf)))
+					elog(NOTICE, "Cancel query failed!");
+				PQfreeCancel(cancel);
+			}
+			pg_fallthrough;
+			/* fallthrough */
+		case C_CONNECT_WRITE:
+		case C_CONNECT_READ:
+			plproxy_disconnect(conn->cur);
+			break;
+		default:
+			break;
+	}
+}
+
+/*
+ * Cancel running query, results are read and ignored
+ * until remote side confirms.  Half-sent query or
+ * login cannot be cancelled, those are dropped.
+ */
+static void
+cancel_conn(ProxyConnection *conn)
+{
+	PGcancel *cancel;
+	char errbuf[256];
+	int ret;
+
+	wait_dirty(conn);
+	switch (conn->cur->state)
+	{
+		case C_NONE:
+		case C_READY:
+		case C_DONE:
+			break;
+		case C_QUERY_WRITE:
+		case C_CONNECT_READ:
+		case C_CONNECT_WRITE:
+			plproxy_disconnect(conn->cur);
+			break;
+		case C_QUERY_READ:
+			cancel = PQgetCancel(conn->cur->db);
+			if (cancel == NULL)
+			{
+				elog(NOTICE, "Invalid connection!");
+				break;
+			}
+			ret = PQcancel(cancel, errbuf, sizeof(errbuf));
+			PQfreeCancel(cancel);
+			if (ret == 0)
+				elog(NOTICE, "Cancel query failed!");
+			else
+				conn->cur->waitCancel = 1;
+			break;
+	}
+}
+
+/*
+ * PARTIAL: leave partition out of results and tell user about it.
+ *
+ * With drop, the connection is abandoned, otherwise rest
+ * of results are read and ignored.
+ */
+static void
+skip_conn(ProxyFunction *func, ProxyConnection *conn,
+		  const char *desc, const char *detail, bool drop)
+{
+	if (!conn->skipped)
+		elog(NOTICE, "PL/Proxy function %s(%d): [%s] skipped: %s%s%s",
+			 func->name, func->arg_count, PQdb(conn->cur->db), desc,
+			 detail ? ": " : "", detail ? detail : "");
+	conn->skipped = true;
+	wait_dirty(conn);
+
+	if (conn->res)
+	{
+		PQclear(conn->res);
+		conn->res = NULL;
+	}
+
+	if (drop)
+	{
+		abandon_conn(conn);
+		func->cur_cluster->wait_rebuild = true;
+	}
+}
+
+/* Has conn finished its part of current execution */
+static bool
+conn_finished(ProxyConnection *conn)
+{
+	if (conn->cur->state == C_DONE)
+		return true;
+
+	/* skipped conn may be dropped or stay after failed tuning query */
+	return conn->skipped
+		&& (conn->cur->state == C_NONE || conn->cur->state == C_READY);
+}
+
 /* Compare if major/minor match. Works on "MAJ.MIN.*" */
 static bool
 cmp_branch(const char *this, const char *that)
@@ -99,6 +251,7 @@ flush_connection(ProxyFunction *func, ProxyConnection *conn)
 
 	/* flush it down */
 	res = PQflush(conn->cur->db);
+	wait_dirty(conn);
 
 	/* set actual state */
 	if (res > 0)
@@ -109,18 +262,200 @@ flush_connection(ProxyFunction *func, ProxyConnection *conn)
 		conn_error(func, conn, "PQflush");
 }
 
+/*
+ * Streaming, result_memory_limit: make current query
+ * return rows in chunks.
+ *
+ * Must be called when the main query is next in line
+ * to return results.
+ */
+static void
+set_stream_mode(ProxyFunction *func, ProxyConnection *conn)
+{
+#ifdef LIBPQ_HAS_CHUNK_MODE
+	ProxyCluster *cluster = func->cur_cluster;
+	int			rows;
+
+	rows = cluster->stream ? cluster->config.stream_chunk_size : PLPROXY_SPILL_CHUNK_ROWS;
+	if (!PQsetChunkedRowsMode(conn->cur->db, rows))
+		conn_error(func, conn, "PQsetChunkedRowsMode");
+#else
+	if (!PQsetSingleRowMode(conn->cur->db))
+		conn_error(func, conn, "PQsetSingleRowMode");
+#endif
+}
+
+/* true if main query has been sent, so parameters are not needed anymore */
+static bool
+query_sent(ProxyConnection *conn)
+{
+	switch (conn->cur->state)
+	{
+		case C_QUERY_WRITE:
+		case C_QUERY_READ:
+		case C_DONE:
+			return !conn->cur->tuning;
+		default:
+			return false;
+	}
+}
+
+/* current time in milliseconds */
+static int64
+get_time_ms(void)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (int64) now.tv_sec * 1000 + now.tv_usec / 1000;
+}
+
+/* current time in microseconds */
+static int64
+get_time_us(void)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (int64) now.tv_sec * 1000000 + now.tv_usec;
+}
+
+/* query finished, update average used by replica selection */
+static void
+update_latency(ProxyConnection *conn)
+{
+	int64		sample = get_time_us() - conn->query_start;
+
+	if (conn->latency)
+		conn->latency += (sample - conn->latency) / 8;
+	else
+		conn->latency = sample;
+	conn->query_start = 0;
+}
+
+/*
+ * Deadline heap.
+ *
+ * Min-heap of connect and query deadlines in current execution.
+ * Entries are not removed when connection gets new deadline,
+ * outdated ones are skipped when they reach top.
+ */
+static void
+deadline_push(ProxyCluster *cluster, ProxyConnection *conn, int64 time)
+{
+	ProxyDeadline *heap;
+	int			i,
+				parent;
+
+	if (cluster->deadline_count >= cluster->deadline_alloc)
+	{
+		int			n = cluster->deadline_alloc ? cluster->deadline_alloc * 2 : 64;
+
+		if (cluster->deadlines)
+			cluster->deadlines = repalloc(cluster->deadlines, n * sizeof(ProxyDeadline));
+		else
+			cluster->deadlines = MemoryContextAlloc(TopMemoryContext, n * sizeof(ProxyDeadline));
+		cluster->deadline_alloc = n;
+	}
+
+	heap = cluster->deadlines;
+	for (i = cluster->deadline_count++; i > 0; i = parent)
+	{
+		parent = (i - 1) / 2;
+		if (heap[parent].time <= time)
+			break;
+		heap[i] = heap[parent];
+	}
+	heap[i].time = time;
+	heap[i].conn = conn;
+}
+
+/* remove top entry */
+static void
+deadline_pop(ProxyCluster *cluster)
+{
+	ProxyDeadline *heap = cluster->deadlines;
+	ProxyDeadline last;
+	int			n,
+				i,
+				child;
+
+	n = --cluster->deadline_count;
+	if (n == 0)
+		return;
+
+	last = heap[n];
+	for (i = 0; (child = 2 * i + 1) < n; i = child)
+	{
+		if (child + 1 < n && heap[child + 1].time < heap[child].time)
+			child++;
+		if (last.time <= heap[child].time)
+			break;
+		heap[i] = heap[child];
+	}
+	heap[i] = last;
+}
+
+/* set connect or query deadline, timeout in ms, 0 means none */
+static void
+set_deadline(ProxyCluster *cluster, ProxyConnection *conn, int timeout)
+{
+	if (timeout <= 0)
+	{
+		conn->deadline = 0;
+		return;
+	}
+	conn->deadline = get_time_ms() + timeout;
+	deadline_push(cluster, conn, conn->deadline);
+}
+
+/* how long poll may sleep, in ms */
+static int
+wait_timeout(ProxyCluster *cluster)
+{
+	int64		next = 0;
+	int64		diff;
+
+	if (cluster->deadline_count > 0)
+		next = cluster->deadlines[0].time;
+	if (cluster->hedge_time && (!next || cluster->hedge_time < next))
+		next = cluster->hedge_time;
+	if (cluster->partial_time && (!next || cluster->partial_time < next))
+		next = cluster->partial_time;
+	if (!next)
+		return 1000;
+
+	diff = next - get_time_ms();
+	if (diff <= 0)
+		return 0;
+	return diff < 1000 ? (int) diff : 1000;
+}
+
+/* forget prepared statement, remote side drops it with tuning queries */
+static List *
+deallocate_stmt(ProxyConnection *conn, ProxyPreparedStmt *stmt, List *stmts)
+{
+	stmts = lappend(stmts, psprintf("deallocate %s", stmt->name));
+	plproxy_remove_prepared(conn->cur, stmt);
+	return stmts;
+}
+
 /*
  * Small sanity checking for new connections.
  *
  * Current checks:
  * - Does there happen any encoding conversations?
+ * - Is prepared statement from older function definition?
+ *
+ * Returns list of statements to run before the query.
  */
-static int
-tune_connection(ProxyFunction *func, ProxyConnection *conn)
+static List *
+tuning_queries(ProxyFunction *func, ProxyConnection *conn)
 {
 	const char *this_enc, *dst_enc;
 	const char *dst_ver;
-	StringInfo	sql = NULL;
+	ProxyPreparedStmt *stmt;
+	List	   *stmts = NIL;
 
 	/*
 	 * check if target server has same backend version.
@@ -134,102 +469,320 @@ tune_connection(ProxyFunction *func, ProxyConnection *conn)
 	this_enc = GetDatabaseEncodingName();
 	dst_enc = PQparameterStatus(conn->cur->db, "client_encoding");
 	if (dst_enc && strcmp(this_enc, dst_enc))
+		stmts = lappend(stmts, psprintf("set client_encoding = '%s'", this_enc));
+
+	/*
+	 * Drop prepared statement if function definition has changed.
+	 * When there is no room for new statement, drop statements of
+	 * functions that have been redefined or dropped meanwhile.
+	 * Prewarm has no query.
+	 */
+	if (func->cur_cluster->config.prepared_statements && func->remote_sql)
+	{
+		stmt = plproxy_find_prepared(conn->cur, func);
+		if (stmt && plproxy_prepared_stale(func, stmt, func->remote_sql->sql))
+		{
+			stmts = deallocate_stmt(conn, stmt, stmts);
+			stmt = NULL;
+		}
+
+		if (!stmt && conn->cur->stmt_tree.count >= PLPROXY_MAX_PREPARED)
+		{
+			List	   *expired = plproxy_expired_prepared(conn->cur);
+			ListCell   *lc;
+
+			foreach(lc, expired)
+				stmts = deallocate_stmt(conn, lfirst(lc), stmts);
+			list_free(expired);
+		}
+	}
+
+	return stmts;
+}
+
+/*
+ * Send tuning statements as separate query.
+ *
+ * Returns true if query was sent, connection goes
+ * back to C_READY when it finishes.
+ */
+static bool
+tune_connection(ProxyFunction *func, ProxyConnection *conn, List *stmts)
+{
+	StringInfoData sql;
+	ListCell   *lc;
+
+	if (!stmts)
 	{
-		if (!sql)
-			sql = makeStringInfo();
-		appendStringInfo(sql, "set client_encoding = '%s'; ", this_enc);
+		conn->cur->tuning = 0;
+		return false;
 	}
 
+	initStringInfo(&sql);
+	foreach(lc, stmts)
+		appendStringInfo(&sql, "%s; ", (char *) lfirst(lc));
+
 	/*
 	 * if second time in this function, they should be active already.
 	 */
-	if (sql && conn->cur->tuning)
+	if (conn->cur->tuning)
 	{
 		/* display SET query */
-		appendStringInfo(sql, "-- does not seem to apply");
-		conn_error(func, conn, sql->data);
+		appendStringInfo(&sql, "-- does not seem to apply");
+		conn_error(func, conn, sql.data);
 	}
 
 	/*
 	 * send tuning query
 	 */
-	if (sql)
-	{
-		conn->cur->tuning = 1;
-		conn->cur->state = C_QUERY_WRITE;
-		if (!PQsendQuery(conn->cur->db, sql->data))
-			conn_error(func, conn, "PQsendQuery");
-		pfree(sql->data);
-		pfree(sql);
-
-		flush_connection(func, conn);
-		return 1;
-	}
+	conn->cur->tuning = 1;
+	conn->cur->state = C_QUERY_WRITE;
+	if (!PQsendQuery(conn->cur->db, sql.data))
+		conn_error(func, conn, "PQsendQuery");
+	pfree(sql.data);
 
-	conn->cur->tuning = 0;
-	return 0;
+	flush_connection(func, conn);
+	return true;
 }
 
-/* send the query to server connection */
+/* queue the actual query, prepared or not */
 static void
-send_query(ProxyFunction *func, ProxyConnection *conn,
-		   const char **values, int *plengths, int *pformats)
+send_remote_query(ProxyFunction *func, ProxyConnection *conn,
+				  ProxyPreparedStmt *stmt, const char **values,
+				  int *plengths, int *pformats, int binary_result)
 {
 	int			res;
-	struct timeval now;
 	ProxyQuery *q = func->remote_sql;
-	ProxyConfig *cf = &func->cur_cluster->config;
-	int			binary_result = 0;
 
-	gettimeofday(&now, NULL);
-	conn->cur->query_time = now.tv_sec;
+	if (stmt)
+	{
+		res = PQsendQueryPrepared(conn->cur->db, stmt->name, q->arg_count,
+								  values,		/* paramValues */
+								  plengths,		/* paramLengths */
+								  pformats,		/* paramFormats */
+								  binary_result);	/* resultformat, 0-text, 1-bin */
+		if (!res)
+			conn_error(func, conn, "PQsendQueryPrepared");
+	}
+	else
+	{
+		res = PQsendQueryParams(conn->cur->db, q->sql, q->arg_count,
+								NULL,		/* paramTypes */
+								values,		/* paramValues */
+								plengths,	/* paramLengths */
+								pformats,	/* paramFormats */
+								binary_result);		/* resultformat, 0-text, 1-bin */
+		if (!res)
+			conn_error(func, conn, "PQsendQueryParams");
+	}
+}
 
-	tune_connection(func, conn);
-	if (conn->cur->tuning)
-		return;
+#ifdef LIBPQ_HAS_PIPELINING
+
+/*
+ * Send tuning statements, prepare and the query itself
+ * in one pipeline, so they take single network roundtrip.
+ *
+ * Results are separated by NULL, PGRES_PIPELINE_SYNC
+ * marks the end.
+ */
+static void
+send_pipeline(ProxyFunction *func, ProxyConnection *conn, List *stmts,
+			  ProxyPreparedStmt *stmt, const char **values,
+			  int *plengths, int *pformats, int binary_result)
+{
+	PGconn	   *db = conn->cur->db;
+	ProxyQuery *q = func->remote_sql;
+	ListCell   *lc;
+
+	conn->cur->state = C_QUERY_WRITE;
+	if (!PQenterPipelineMode(db))
+		conn_error(func, conn, "PQenterPipelineMode");
 
-	/* use binary result only on same backend ver */
-	if (cf->disable_binary == 0 && conn->cur->same_ver)
+	/* extended protocol allows only one statement per query */
+	foreach(lc, stmts)
 	{
-		/* binary recv for non-record types */
-		if (func->ret_scalar)
-		{
-			if (func->ret_scalar->has_recv)
-				binary_result = 1;
-		}
-		else
+		if (!PQsendQueryParams(db, lfirst(lc), 0, NULL, NULL, NULL, NULL, 0))
+			conn_error(func, conn, "PQsendQueryParams");
+	}
+	conn->cur->tuning_results = list_length(stmts);
+
+	if (conn->cur->stmt_pending)
+	{
+		if (!PQsendPrepare(db, stmt->name, q->sql, q->arg_count, NULL))
 		{
-			if (func->ret_composite->use_binary)
-				binary_result = 1;
+			plproxy_drop_pending(conn->cur);
+			conn_error(func, conn, "PQsendPrepare");
 		}
 	}
+	conn->cur->pipeline_skip = conn->cur->tuning_results + (conn->cur->stmt_pending ? 1 : 0);
 
-	/* send query */
-	conn->cur->state = C_QUERY_WRITE;
-	res = PQsendQueryParams(conn->cur->db, q->sql, q->arg_count,
-							NULL,		/* paramTypes */
-							values,		/* paramValues */
-							plengths,	/* paramLengths */
-							pformats,	/* paramFormats */
-							binary_result);		/* resultformat, 0-text, 1-bin */
-	if (!res)
-		conn_error(func, conn, "PQsendQueryParams");
+	send_remote_query(func, conn, stmt, values, plengths, pformats, binary_result);
+
+	/* otherwise set when results for previous queries are read */
+	if ((func->cur_cluster->stream || func->cur_cluster->spill)
+		&& conn->cur->pipeline_skip == 0)
+		set_stream_mode(func, conn);
+
+	if (!PQpipelineSync(db))
+		conn_error(func, conn, "PQpipelineSync");
 
-	/* flush it down */
 	flush_connection(func, conn);
 }
 
-/* returns false of conn should be dropped */
-static bool
-check_old_conn(ProxyFunction *func, ProxyConnection *conn, struct timeval * now)
-{
-	time_t		t;
-	int			res;
-	struct pollfd	pfd;
-	ProxyConfig *cf = &func->cur_cluster->config;
+#endif
 
-	if (PQstatus(conn->cur->db) != CONNECTION_OK)
-		return false;
+/*
+ * Fill connection parameters in requested format.
+ * Fixed values are encoded once per format.
+ */
+static void
+encode_params(ProxyFunction *func, ProxyConnection *conn, bool bin)
+{
+	ProxyQuery *q = func->remote_sql;
+	ProxyParam *p;
+	ProxyType  *type;
+	int			i;
+
+	for (i = 0; i < q->arg_count; i++)
+	{
+		p = &func->cur_cluster->params[i];
+		type = func->arg_types[q->arg_lookup[i]];
+
+		if (p->isnull)
+		{
+			conn->param_values[i] = NULL;
+			conn->param_lengths[i] = 0;
+			conn->param_formats[i] = 0;
+		}
+		else if (p->split)
+		{
+			conn->param_values[i] = plproxy_send_type(type,
+													  conn->split_params[q->arg_lookup[i]],
+													  bin,
+													  &conn->param_lengths[i],
+													  &conn->param_formats[i]);
+		}
+		else
+		{
+			if (!p->data[bin])
+				p->data[bin] = plproxy_send_type(type, p->value, bin,
+												 &p->length[bin],
+												 &p->format[bin]);
+			conn->param_values[i] = p->data[bin];
+			conn->param_lengths[i] = p->length[bin];
+			conn->param_formats[i] = p->format[bin];
+		}
+	}
+}
+
+/* send the query to server connection */
+static void
+send_query(ProxyFunction *func, ProxyConnection *conn)
+{
+	const char **values = conn->param_values;
+	int		   *plengths = conn->param_lengths;
+	int		   *pformats = conn->param_formats;
+	struct timeval now;
+	ProxyQuery *q = func->remote_sql;
+	ProxyConfig *cf = &func->cur_cluster->config;
+	ProxyPreparedStmt *stmt = NULL;
+	List	   *stmts;
+	bool		binary_io;
+	int			binary_result = 0;
+
+	gettimeofday(&now, NULL);
+	conn->cur->query_time = now.tv_sec;
+	conn->query_start = get_time_us();
+	set_deadline(func->cur_cluster, conn, cf->query_timeout);
+	conn->result_mapped = false;
+
+	stmts = tuning_queries(func, conn);
+#ifndef LIBPQ_HAS_PIPELINING
+	if (tune_connection(func, conn, stmts))
+		return;
+#endif
+
+	/* use binary I/O only on same backend ver */
+	binary_io = cf->disable_binary == 0 && conn->cur->same_ver;
+	encode_params(func, conn, binary_io);
+	/*
+	 * Binary result only when query casts columns to local types,
+	 * custom SELECT may return other types that text input accepts.
+	 */
+	if (binary_io && q->typed_result)
+	{
+		/* binary recv for non-record types */
+		if (func->ret_scalar)
+		{
+			if (func->ret_scalar->has_recv)
+				binary_result = 1;
+		}
+		else
+		{
+			if (func->ret_composite->use_binary)
+				binary_result = 1;
+		}
+	}
+
+	/* prepare query on first use */
+	if (cf->prepared_statements)
+	{
+		stmt = plproxy_find_prepared(conn->cur, func);
+		if (!stmt && conn->cur->stmt_tree.count < PLPROXY_MAX_PREPARED)
+		{
+			plproxy_drop_pending(conn->cur);
+			stmt = plproxy_new_prepared(conn->cur, func, q->sql);
+			conn->cur->stmt_pending = stmt;
+		}
+	}
+
+#ifdef LIBPQ_HAS_PIPELINING
+	/* batch everything into one roundtrip */
+	if (stmts || conn->cur->stmt_pending)
+	{
+		send_pipeline(func, conn, stmts, stmt, values, plengths, pformats, binary_result);
+		list_free_deep(stmts);
+		return;
+	}
+#else
+	/* without pipeline, prepare runs as separate roundtrip like tuning query */
+	if (conn->cur->stmt_pending)
+	{
+		conn->cur->tuning = 1;
+		conn->cur->state = C_QUERY_WRITE;
+		if (!PQsendPrepare(conn->cur->db, stmt->name, q->sql,
+						   q->arg_count, NULL))
+		{
+			plproxy_drop_pending(conn->cur);
+			conn_error(func, conn, "PQsendPrepare");
+		}
+		flush_connection(func, conn);
+		return;
+	}
+#endif
+
+	/* send query */
+	conn->cur->state = C_QUERY_WRITE;
+	send_remote_query(func, conn, stmt, values, plengths, pformats, binary_result);
+	if (func->cur_cluster->stream || func->cur_cluster->spill)
+		set_stream_mode(func, conn);
+
+	/* flush it down */
+	flush_connection(func, conn);
+}
+
+/* returns false of conn should be dropped */
+static bool
+check_old_conn(ProxyFunction *func, ProxyConnection *conn, struct timeval * now)
+{
+	time_t		t;
+	int			res;
+	struct pollfd	pfd;
+	ProxyConfig *cf = &func->cur_cluster->config;
+
+	if (PQstatus(conn->cur->db) != CONNECTION_OK)
+		return false;
 
 	/* check if too old */
 	if (cf->connection_lifetime > 0)
@@ -297,60 +850,6 @@ get_connstr(ProxyConnection *conn)
 	return cstr.data;
 }
 
-/* check existing conn status or launch new conn */
-static void
-prepare_conn(ProxyFunction *func, ProxyConnection *conn)
-{
-	struct timeval now;
-	const char *connstr;
-
-	gettimeofday(&now, NULL);
-
-	conn->cur->waitCancel = 0;
-
-	/* state should be C_READY or C_NONE */
-	switch (conn->cur->state)
-	{
-		case C_DONE:
-			conn->cur->state = C_READY;
-			pg_fallthrough;
-			/* fallthrough */
-		case C_READY:
-			if (check_old_conn(func, conn, &now))
-				return;
-			pg_fallthrough;
-			/* fallthrough */
-		case C_CONNECT_READ:
-		case C_CONNECT_WRITE:
-		case C_QUERY_READ:
-		case C_QUERY_WRITE:
-			/* close rotten connection */
-			elog(NOTICE, "PL/Proxy: dropping stale conn");
-			plproxy_disconnect(conn->cur);
-			pg_fallthrough;
-			/* fallthrough */
-		case C_NONE:
-			break;
-	}
-
-	conn->cur->connect_time = now.tv_sec;
-
-	/* launch new connection */
-	connstr = get_connstr(conn);
-	conn->cur->db = PQconnectStart(connstr);
-	if (conn->cur->db == NULL)
-		plproxy_error(func, "No memory for PGconn");
-
-	/* tag connection dirty */
-	conn->cur->state = C_CONNECT_WRITE;
-
-	if (PQstatus(conn->cur->db) == CONNECTION_BAD)
-		conn_error(func, conn, "PQconnectStart");
-
-	/* override default notice handler */
-	PQsetNoticeReceiver(conn->cur->db, handle_notice, conn);
-}
-
 /*
  * Connection has a resultset avalable, fetch it.
  *
@@ -366,6 +865,17 @@ another_result(ProxyFunction *func, ProxyConnection *conn)
 	res = PQgetResult(conn->cur->db);
 	if (res == NULL)
 	{
+#ifdef LIBPQ_HAS_PIPELINING
+		/* end of one query in pipeline, more results follow */
+		if (PQpipelineStatus(conn->cur->db) != PQ_PIPELINE_OFF)
+		{
+			/* main query is next */
+			if (conn->cur->pipeline_skip > 0 && --conn->cur->pipeline_skip == 0
+				&& (func->cur_cluster->stream || func->cur_cluster->spill))
+				set_stream_mode(func, conn);
+			return true;
+		}
+#endif
 		conn->cur->waitCancel = 0;
 		if (conn->cur->tuning)
 			conn->cur->state = C_READY;
@@ -374,8 +884,25 @@ another_result(ProxyFunction *func, ProxyConnection *conn)
 		return false;
 	}
 
-	/* ignore result when waiting for cancel */
-	if (conn->cur->waitCancel)
+#ifdef LIBPQ_HAS_PIPELINING
+	/* end of pipeline */
+	if (PQresultStatus(res) == PGRES_PIPELINE_SYNC)
+	{
+		PQclear(res);
+		if (!PQexitPipelineMode(conn->cur->db))
+			conn_error(func, conn, "PQexitPipelineMode");
+		conn->cur->waitCancel = 0;
+		conn->cur->state = C_DONE;
+		return false;
+	}
+#endif
+
+	/*
+	 * Ignore result when waiting for cancel or partition was skipped,
+	 * but remember statements that got prepared.
+	 */
+	if ((conn->cur->waitCancel || conn->skipped)
+		&& PQresultStatus(res) != PGRES_COMMAND_OK)
 	{
 		PQclear(res);
 		return true;
@@ -384,17 +911,69 @@ another_result(ProxyFunction *func, ProxyConnection *conn)
 	switch (PQresultStatus(res))
 	{
 		case PGRES_TUPLES_OK:
+			/* streaming: final result without rows */
+			if ((func->cur_cluster->stream || func->cur_cluster->spill)
+				&& PQntuples(res) == 0)
+			{
+				PQclear(res);
+				break;
+			}
+			if (conn->res)
+			{
+				PQclear(res);
+				conn_error(func, conn, "double result?");
+			}
+			conn->res = res;
+			conn->res_seq = ++func->cur_cluster->res_counter;
+			if (func->cur_cluster->spill)
+				plproxy_spill_result(func, conn);
+			break;
+		case PGRES_SINGLE_TUPLE:
+#ifdef LIBPQ_HAS_CHUNK_MODE
+		case PGRES_TUPLES_CHUNK:
+#endif
 			if (conn->res)
 			{
 				PQclear(res);
 				conn_error(func, conn, "double result?");
 			}
 			conn->res = res;
+			conn->res_seq = ++func->cur_cluster->res_counter;
+
+			/* result_memory_limit: store rows, release chunk */
+			if (func->cur_cluster->spill)
+			{
+				plproxy_spill_result(func, conn);
+				break;
+			}
+
+			/* query_timeout applies to waiting for next chunk */
+			set_deadline(func->cur_cluster, conn, func->cur_cluster->config.query_timeout);
 			break;
 		case PGRES_COMMAND_OK:
+			/* successful prepare, remember statement */
+			if (conn->cur->tuning_results > 0)
+				conn->cur->tuning_results--;
+			else if (conn->cur->stmt_pending)
+			{
+				plproxy_add_prepared(conn->cur, conn->cur->stmt_pending);
+				conn->cur->stmt_pending = NULL;
+			}
 			PQclear(res);
 			break;
 		case PGRES_FATAL_ERROR:
+			/* statement was not prepared, or pipeline was aborted before it */
+			plproxy_drop_pending(conn->cur);
+
+			/* PARTIAL: pass error through as warning, read rest of results */
+			if (func->partial)
+			{
+				plproxy_remote_error(func, conn, res, false);
+				PQclear(res);
+				skip_conn(func, conn, "remote error", NULL, false);
+				break;
+			}
+
 			if (conn->res)
 				PQclear(conn->res);
 			conn->res = res;
@@ -413,104 +992,440 @@ another_result(ProxyFunction *func, ProxyConnection *conn)
 }
 
 /*
- * Called when select() told that conn is avail for reading/writing.
+ * Read results already buffered in libpq.
  *
- * It should call postgres handlers and then change state if needed.
+ * In streaming mode stops when a chunk is received,
+ * the rest is read after it has been returned.
  */
 static void
-handle_conn(ProxyFunction *func, ProxyConnection *conn)
+drain_conn(ProxyFunction *func, ProxyConnection *conn)
 {
-	int			res;
-	PostgresPollingStatusType poll_res;
+	wait_dirty(conn);
 
-	switch (conn->cur->state)
+	/* loop until PQgetResult returns NULL */
+	while (1)
 	{
-		case C_CONNECT_READ:
-		case C_CONNECT_WRITE:
-			poll_res = PQconnectPoll(conn->cur->db);
-			switch (poll_res)
-			{
-				case PGRES_POLLING_WRITING:
-					conn->cur->state = C_CONNECT_WRITE;
-					break;
-				case PGRES_POLLING_READING:
-					conn->cur->state = C_CONNECT_READ;
-					break;
-				case PGRES_POLLING_OK:
-					conn->cur->state = C_READY;
-					break;
-				case PGRES_POLLING_ACTIVE:
-				case PGRES_POLLING_FAILED:
-					conn_error(func, conn, "PQconnectPoll");
-			}
-			break;
-		case C_QUERY_WRITE:
-			flush_connection(func, conn);
+		/* streaming: wait until rows are returned */
+		if (func->cur_cluster->stream && conn->res)
 			break;
-		case C_QUERY_READ:
-			res = PQconsumeInput(conn->cur->db);
-			if (res == 0)
-				conn_error(func, conn, "PQconsumeInput");
 
-			/* loop until PQgetResult returns NULL */
-			while (1)
-			{
-				/* if PQisBusy, then incomplete result */
-				if (PQisBusy(conn->cur->db))
-					break;
+		/* if PQisBusy, then incomplete result */
+		if (PQisBusy(conn->cur->db))
+			break;
 
-				/* got one */
-				if (!another_result(func, conn))
-					break;
-			}
-		case C_NONE:
-		case C_DONE:
-		case C_READY:
+		/* got one */
+		if (!another_result(func, conn))
 			break;
 	}
 }
 
 /*
- * Check if tagged connections have interesting events.
- *
- * Currenly uses select() as it should be enough
- * on small number of sockets.
+ * Read results of a query that was cancelled without waiting,
+ * they are ignored.  Connection stays in C_QUERY_READ if
+ * they have not all arrived, then it is dropped.
  */
-static int
-poll_conns(ProxyFunction *func, ProxyCluster *cluster)
+static void
+finish_cancelled(ProxyFunction *func, ProxyConnection *conn)
 {
-	static struct pollfd *pfd_cache = NULL;
-	static int pfd_allocated = 0;
-
-	int			i,
-				res,
-				fd;
-	ProxyConnection *conn;
-	struct pollfd *pf;
-	int numfds = 0;
-	int ev = 0;
-
-	if (pfd_allocated < cluster->active_count)
+	if (!PQconsumeInput(conn->cur->db))
+		return;
+	drain_conn(func, conn);
+	if (conn->res)
 	{
-		struct pollfd *tmp;
-		int num = cluster->active_count;
-		if (num < 64)
-			num = 64;
-		if (pfd_cache == NULL)
-			tmp = malloc(num * sizeof(struct pollfd));
-		else
-			tmp = realloc(pfd_cache, num * sizeof(struct pollfd));
-		if (!tmp)
-			elog(ERROR, "no mem for pollfd cache");
-		pfd_cache = tmp;
-		pfd_allocated = num;
+		PQclear(conn->res);
+		conn->res = NULL;
 	}
+}
 
-	for (i = 0; i < cluster->active_count; i++)
-	{
-		conn = cluster->active_list[i];
-		if (!conn->run_tag)
-			continue;
+/* check existing conn status or launch new conn */
+static void
+prepare_conn(ProxyFunction *func, ProxyConnection *conn)
+{
+	struct timeval now;
+	const char *connstr;
+
+	gettimeofday(&now, NULL);
+
+	/* query cancelled by earlier call may have finished by now */
+	if (conn->cur->state == C_QUERY_READ && conn->cur->waitCancel)
+		finish_cancelled(func, conn);
+
+	conn->cur->waitCancel = 0;
+	wait_dirty(conn);
+
+	/* state should be C_READY or C_NONE */
+	switch (conn->cur->state)
+	{
+		case C_DONE:
+			conn->cur->state = C_READY;
+			pg_fallthrough;
+			/* fallthrough */
+		case C_READY:
+			if (check_old_conn(func, conn, &now))
+				return;
+			pg_fallthrough;
+			/* fallthrough */
+		case C_CONNECT_READ:
+		case C_CONNECT_WRITE:
+		case C_QUERY_READ:
+		case C_QUERY_WRITE:
+			/* close rotten connection */
+			elog(NOTICE, "PL/Proxy: dropping stale conn");
+			plproxy_disconnect(conn->cur);
+			pg_fallthrough;
+			/* fallthrough */
+		case C_NONE:
+			break;
+	}
+
+	conn->cur->connect_time = now.tv_sec;
+
+	/* launch new connection */
+	connstr = get_connstr(conn);
+	conn->cur->db = PQconnectStart(connstr);
+	if (conn->cur->db == NULL)
+		plproxy_error(func, "No memory for PGconn");
+
+	/* tag connection dirty */
+	conn->cur->state = C_CONNECT_WRITE;
+	set_deadline(func->cur_cluster, conn, func->cur_cluster->config.connect_timeout);
+
+	if (PQstatus(conn->cur->db) == CONNECTION_BAD)
+		conn_error(func, conn, "PQconnectStart");
+
+	/* override default notice handler */
+	PQsetNoticeReceiver(conn->cur->db, handle_notice, conn);
+}
+
+/*
+ * Called when select() told that conn is avail for reading/writing.
+ *
+ * It should call postgres handlers and then change state if needed.
+ */
+static void
+handle_conn(ProxyFunction *func, ProxyConnection *conn)
+{
+	int			res;
+	PostgresPollingStatusType poll_res;
+
+	wait_dirty(conn);
+	switch (conn->cur->state)
+	{
+		case C_CONNECT_READ:
+		case C_CONNECT_WRITE:
+			poll_res = PQconnectPoll(conn->cur->db);
+			switch (poll_res)
+			{
+				case PGRES_POLLING_WRITING:
+					conn->cur->state = C_CONNECT_WRITE;
+					break;
+				case PGRES_POLLING_READING:
+					conn->cur->state = C_CONNECT_READ;
+					break;
+				case PGRES_POLLING_OK:
+					conn->cur->state = C_READY;
+					break;
+				case PGRES_POLLING_ACTIVE:
+				case PGRES_POLLING_FAILED:
+					if (func->partial)
+					{
+						skip_conn(func, conn, "PQconnectPoll",
+								  PQerrorMessage(conn->cur->db), true);
+						break;
+					}
+					conn_error(func, conn, "PQconnectPoll");
+			}
+			break;
+		case C_QUERY_WRITE:
+			flush_connection(func, conn);
+			break;
+		case C_QUERY_READ:
+			res = PQconsumeInput(conn->cur->db);
+			if (res == 0 && func->partial)
+			{
+				skip_conn(func, conn, "PQconsumeInput",
+						  PQerrorMessage(conn->cur->db), true);
+				break;
+			}
+			if (res == 0)
+				conn_error(func, conn, "PQconsumeInput");
+
+			drain_conn(func, conn);
+		case C_NONE:
+		case C_DONE:
+		case C_READY:
+			break;
+	}
+}
+
+#ifdef USE_WAIT_EVENT_SET
+
+/* max events to handle on one wakeup */
+#define MAX_WAIT_EVENTS		64
+
+/* which socket events connection waits for, 0 if none */
+static uint32
+conn_wait_events(ProxyCluster *cluster, ProxyConnection *conn)
+{
+	/* streaming: rows not yet returned */
+	if (cluster->stream && conn->res)
+		return 0;
+
+	switch (conn->cur->state)
+	{
+		case C_CONNECT_READ:
+		case C_QUERY_READ:
+			return WL_SOCKET_READABLE;
+		case C_CONNECT_WRITE:
+		case C_QUERY_WRITE:
+			return WL_SOCKET_WRITEABLE;
+		default:
+			return 0;
+	}
+}
+
+/* forget dirty list, registrations are checked on build */
+static void
+clear_wait_dirty(ProxyCluster *cluster)
+{
+	int			i;
+
+	for (i = 0; i < cluster->wait_dirty_count; i++)
+		cluster->wait_dirty[i]->wait_dirty = false;
+	cluster->wait_dirty_count = 0;
+}
+
+static void
+free_wait_set(ProxyCluster *cluster)
+{
+	if (cluster->wait_set)
+	{
+		FreeWaitEventSet(cluster->wait_set);
+		cluster->wait_set = NULL;
+	}
+	clear_wait_dirty(cluster);
+}
+
+/*
+ * Create wait set with latch, postmaster death and sockets
+ * of connections that are waiting for something.
+ *
+ * It stays alive during whole execution, connections that
+ * finish are parked with no events.  It is created again
+ * only when connection sockets change.
+ */
+static void
+build_wait_set(ProxyCluster *cluster)
+{
+	WaitEventSet *set;
+	ProxyConnection *conn;
+	uint32		ev;
+	int			i;
+
+	free_wait_set(cluster);
+
+#if PG_VERSION_NUM >= 170000
+	set = CreateWaitEventSet(CurrentResourceOwner, cluster->active_count + 2);
+#else
+	/* must survive SPI_finish() when streaming */
+	set = CreateWaitEventSet(TopMemoryContext, cluster->active_count + 2);
+#endif
+	cluster->wait_set = set;
+	cluster->wait_rebuild = false;
+	cluster->wait_size = cluster->active_count + 2;
+
+	AddWaitEventToSet(set, WL_LATCH_SET, PGINVALID_SOCKET, MyLatch, NULL);
+	AddWaitEventToSet(set, WL_POSTMASTER_DEATH, PGINVALID_SOCKET, NULL, NULL);
+	cluster->wait_count = 2;
+
+	for (i = 0; i < cluster->active_count; i++)
+	{
+		conn = cluster->active_list[i];
+		conn->wait_pos = -1;
+		conn->wait_events = 0;
+		if (!conn->run_tag)
+			continue;
+
+		ev = conn_wait_events(cluster, conn);
+		if (!ev)
+			continue;
+
+		conn->wait_fd = PQsocket(conn->cur->db);
+		conn->wait_events = ev;
+		conn->wait_pos = AddWaitEventToSet(set, ev, conn->wait_fd, NULL, conn);
+		cluster->wait_count++;
+	}
+}
+
+/*
+ * Update registrations of connections that changed state
+ * since last wait, others are not looked at.
+ *
+ * Connection without interesting events is parked by setting
+ * no events, new socket or closed one needs new set.
+ */
+static void
+update_wait_set(ProxyCluster *cluster)
+{
+	ProxyConnection *conn;
+	uint32		ev;
+	int			i,
+				fd;
+
+	for (i = 0; i < cluster->wait_dirty_count; i++)
+	{
+		conn = cluster->wait_dirty[i];
+		conn->wait_dirty = false;
+		if (cluster->wait_rebuild)
+			continue;
+
+		ev = conn->run_tag ? conn_wait_events(cluster, conn) : 0;
+		fd = PQsocket(conn->cur->db);
+
+		if (conn->wait_pos < 0)
+		{
+			if (!ev)
+				continue;
+			if (cluster->wait_count >= cluster->wait_size)
+			{
+				cluster->wait_rebuild = true;
+				continue;
+			}
+			conn->wait_fd = fd;
+			conn->wait_events = ev;
+			conn->wait_pos = AddWaitEventToSet(cluster->wait_set, ev, fd, NULL, conn);
+			cluster->wait_count++;
+		}
+		else if (fd != conn->wait_fd)
+			cluster->wait_rebuild = true;
+		else if (ev != conn->wait_events)
+		{
+			ModifyWaitEvent(cluster->wait_set, conn->wait_pos, ev, NULL);
+			conn->wait_events = ev;
+		}
+	}
+	cluster->wait_dirty_count = 0;
+}
+
+/*
+ * Check if tagged connections have interesting events.
+ *
+ * Uses WaitEventSet, so only sockets with events are
+ * touched after wakeup, and latch wakes up immediately
+ * on interrupts.
+ */
+static int
+poll_conns(ProxyFunction *func, ProxyCluster *cluster)
+{
+	WaitEvent	events[MAX_WAIT_EVENTS];
+	ProxyConnection *conn;
+	int			i,
+				n,
+				handled = 0;
+
+	if (cluster->wait_set && !cluster->wait_rebuild)
+		update_wait_set(cluster);
+	if (!cluster->wait_set || cluster->wait_rebuild)
+		build_wait_set(cluster);
+
+	/* wait for events */
+	n = WaitEventSetWait(cluster->wait_set, wait_timeout(cluster),
+						 events, MAX_WAIT_EVENTS, PG_WAIT_EXTENSION);
+
+	for (i = 0; i < n; i++)
+	{
+		if (events[i].events & WL_POSTMASTER_DEATH)
+			ereport(FATAL,
+					(errcode(ERRCODE_ADMIN_SHUTDOWN),
+					 errmsg("terminating connection due to unexpected postmaster exit")));
+
+		if (events[i].events & WL_LATCH_SET)
+		{
+			/* caller does CHECK_FOR_INTERRUPTS() */
+			ResetLatch(MyLatch);
+			continue;
+		}
+
+		conn = events[i].user_data;
+
+		/* state changed after registration, park it */
+		if (conn_wait_events(cluster, conn) == 0)
+		{
+			wait_dirty(conn);
+			continue;
+		}
+
+		/*
+		 * Connect may switch sockets, register again.
+		 */
+		switch (conn->cur->state)
+		{
+			case C_CONNECT_READ:
+			case C_CONNECT_WRITE:
+				cluster->wait_rebuild = true;
+				break;
+			default:
+				break;
+		}
+
+		handle_conn(func, conn);
+		handled++;
+	}
+	return handled > 0;
+}
+
+#else
+
+static void
+free_wait_set(ProxyCluster *cluster)
+{
+}
+
+/*
+ * Check if tagged connections have interesting events.
+ *
+ * Currenly uses select() as it should be enough
+ * on small number of sockets.
+ */
+static int
+poll_conns(ProxyFunction *func, ProxyCluster *cluster)
+{
+	static struct pollfd *pfd_cache = NULL;
+	static int pfd_allocated = 0;
+
+	int			i,
+				res,
+				fd;
+	ProxyConnection *conn;
+	struct pollfd *pf;
+	int numfds = 0;
+	int ev = 0;
+
+	if (pfd_allocated < cluster->active_count)
+	{
+		struct pollfd *tmp;
+		int num = cluster->active_count;
+		if (num < 64)
+			num = 64;
+		if (pfd_cache == NULL)
+			tmp = malloc(num * sizeof(struct pollfd));
+		else
+			tmp = realloc(pfd_cache, num * sizeof(struct pollfd));
+		if (!tmp)
+			elog(ERROR, "no mem for pollfd cache");
+		pfd_cache = tmp;
+		pfd_allocated = num;
+	}
+
+	for (i = 0; i < cluster->active_count; i++)
+	{
+		conn = cluster->active_list[i];
+		if (!conn->run_tag)
+			continue;
+
+		/* streaming: rows not yet returned */
+		if (cluster->stream && conn->res)
+			continue;
 
 		/* decide what to do */
 		switch (conn->cur->state)
@@ -537,7 +1452,7 @@ poll_conns(ProxyFunction *func, ProxyCluster *cluster)
 	}
 
 	/* wait for events */
-	res = poll(pfd_cache, numfds, 1000);
+	res = poll(pfd_cache, numfds, wait_timeout(cluster));
 	if (res == 0)
 		return 0;
 	if (res < 0)
@@ -555,6 +1470,9 @@ poll_conns(ProxyFunction *func, ProxyCluster *cluster)
 		if (!conn->run_tag)
 			continue;
 
+		if (cluster->stream && conn->res)
+			continue;
+
 		switch (conn->cur->state)
 		{
 			case C_DONE:
@@ -583,46 +1501,224 @@ poll_conns(ProxyFunction *func, ProxyCluster *cluster)
 	return 1;
 }
 
+#endif
+
 /* Check if some operation has gone over limit */
 static void
-check_timeouts(ProxyFunction *func, ProxyCluster *cluster, ProxyConnection *conn, time_t now)
+check_deadlines(ProxyFunction *func, ProxyCluster *cluster)
 {
-	ProxyConfig *cf = &cluster->config;
+	ProxyConnection *conn;
+	int64		now = get_time_ms();
+	int64		time;
 
-	switch (conn->cur->state)
+	while (cluster->deadline_count > 0 && cluster->deadlines[0].time <= now)
 	{
-		case C_CONNECT_READ:
-		case C_CONNECT_WRITE:
-			if (cf->connect_timeout <= 0)
-				break;
-			if (now - conn->cur->connect_time <= cf->connect_timeout)
-				break;
-			plproxy_error(func, "connect timeout to: %s", conn->connstr);
-			break;
+		conn = cluster->deadlines[0].conn;
+		time = cluster->deadlines[0].time;
+		deadline_pop(cluster);
 
-		case C_QUERY_READ:
-		case C_QUERY_WRITE:
-			if (cf->query_timeout <= 0)
+		/* outdated entry */
+		if (conn->deadline != time)
+			continue;
+
+		/* streaming: conn is waiting for us */
+		if (cluster->stream && conn->res)
+			continue;
+
+		switch (conn->cur->state)
+		{
+			case C_CONNECT_READ:
+			case C_CONNECT_WRITE:
+				if (func->partial)
+				{
+					skip_conn(func, conn, "connect timeout", NULL, true);
+					break;
+				}
+				plproxy_error(func, "connect timeout to: %s", conn->connstr);
 				break;
-			if (now - conn->cur->query_time <= cf->query_timeout)
+			case C_QUERY_READ:
+			case C_QUERY_WRITE:
+				/* LIMIT: cancelled query is not worth waiting for */
+				if (func->partial || conn->skipped)
+				{
+					skip_conn(func, conn, "query timeout", NULL, true);
+					break;
+				}
+				plproxy_error(func, "query timeout");
 				break;
-			plproxy_error(func, "query timeout");
-			break;
-		default:
-			break;
+			default:
+				break;
+		}
 	}
 }
 
+/*
+ * Hedged RUN ON ANY.
+ *
+ * If the partition does not answer in hedge_delay, the query
+ * is sent to second partition too, first answer is used.
+ */
+
+static int
+cmp_int(const void *a, const void *b)
+{
+	int			x = *(const int *) a;
+	int			y = *(const int *) b;
+
+	return (x > y) - (x < y);
+}
+
+/* fixed delay, or percentile of recent latencies with fixed as minimum */
+static int
+get_hedge_delay(ProxyCluster *cluster)
+{
+	ProxyConfig *cf = &cluster->config;
+	int			sorted[PLPROXY_HEDGE_SAMPLES];
+	int			n = cluster->hedge_nsamples;
+	int			delay;
+
+	if (cf->hedge_percentile <= 0 || n < PLPROXY_HEDGE_SAMPLES / 4)
+		return cf->hedge_delay;
+
+	memcpy(sorted, cluster->hedge_samples, n * sizeof(int));
+	qsort(sorted, n, sizeof(int), cmp_int);
+	delay = sorted[(n - 1) * cf->hedge_percentile / 100];
+
+	return delay > cf->hedge_delay ? delay : cf->hedge_delay;
+}
+
+static void
+add_hedge_sample(ProxyCluster *cluster, int64 msecs)
+{
+	cluster->hedge_samples[cluster->hedge_pos] = msecs < INT_MAX ? msecs : INT_MAX;
+	cluster->hedge_pos = (cluster->hedge_pos + 1) % PLPROXY_HEDGE_SAMPLES;
+	if (cluster->hedge_nsamples < PLPROXY_HEDGE_SAMPLES)
+		cluster->hedge_nsamples++;
+}
+
+/*
+ * Query may run on two partitions, so only READONLY functions
+ * without SPLIT are hedged.
+ */
+static bool
+can_hedge(ProxyFunction *func, ProxyCluster *cluster)
+{
+	return func->run_type == R_ANY && func->read_only && !func->split_args
+		&& cluster->config.hedge_delay > 0 && cluster->part_count > 1;
+}
+
+/* send query to random partition that does not share connection with first one */
+static void
+send_hedge(ProxyFunction *func)
+{
+	ProxyCluster *cluster = func->cur_cluster;
+	ProxyConnection *first = cluster->active_list[0];
+	ProxyConnection *conn = first;
+	int			i,
+				idx;
+
+	idx = plproxy_random() % cluster->part_count;
+	for (i = 0; i < cluster->part_count && conn == first; i++)
+		conn = cluster->part_map[(idx + i) % cluster->part_count];
+	if (conn == first)
+		return;
+
+	plproxy_activate_connection(conn);
+	conn->run_tag = first->run_tag;
+	conn->split_params = first->split_params;
+
+	/* wait set was built without it */
+	cluster->wait_rebuild = true;
+
+	prepare_conn(func, conn);
+	if (conn->cur->state == C_READY)
+		send_query(func, conn);
+}
+
+/*
+ * Stop the slower partition.  Cancel is sent without waiting
+ * for it, rest of results are read when the connection is used
+ * next time.  Connection that cannot be cancelled is dropped.
+ */
+static void
+drop_hedge_loser(ProxyConnection *conn)
+{
+	conn->run_tag = 0;
+	if (conn->res)
+	{
+		PQclear(conn->res);
+		conn->res = NULL;
+	}
+
+	/* results are ignored, do not switch them to chunks */
+	conn->cur->pipeline_skip = 0;
+
+	cancel_conn(conn);
+	if (conn->cur->state == C_QUERY_READ && !conn->cur->waitCancel)
+		plproxy_disconnect(conn->cur);
+}
+
+/*
+ * LIMIT: finished partitions gave enough rows, cancel
+ * the rest and leave them out of results.
+ *
+ * Returns number of connections still waiting for cancel.
+ */
+static int
+stop_unfinished(ProxyFunction *func)
+{
+	ProxyConnection *conn;
+	ProxyCluster *cluster = func->cur_cluster;
+	int			i,
+				pending = 0;
+
+	for (i = 0; i < cluster->active_count; i++)
+	{
+		conn = cluster->active_list[i];
+		if (!conn->run_tag || conn_finished(conn))
+			continue;
+
+		cancel_conn(conn);
+		conn->skipped = true;
+		if (conn->res)
+		{
+			PQclear(conn->res);
+			conn->res = NULL;
+		}
+		if (!conn_finished(conn))
+			pending++;
+	}
+	cluster->wait_rebuild = true;
+	return pending;
+}
+
 /* Run the query on all tagged connections in parallel */
 static void
 remote_execute(ProxyFunction *func)
 {
 	ExecStatusType err;
 	ProxyConnection *conn;
+	ProxyConnection *winner = NULL;
 	ProxyCluster *cluster = func->cur_cluster;
+	int64		start = 0;
+	int64		limit_rows = -1,
+				done_rows;
 	int			i,
 				pending = 0;
-	struct timeval now;
+
+	/* RUN ON ANY on replicated partitions may use hedging */
+	if (can_hedge(func, cluster) && cluster->active_count == 1 && !cluster->stream)
+	{
+		start = get_time_ms();
+		cluster->hedge_time = start + get_hedge_delay(cluster);
+	}
+
+	if (func->partial_timeout > 0)
+		cluster->partial_time = get_time_ms() + func->partial_timeout;
+
+	/* LIMIT: without ORDER BY, rows from any partitions will do */
+	if (!cluster->stream && !start && func->order_count == 0)
+		limit_rows = cluster->ret_limit;
 
 	/* either launch connection or send query */
 	for (i = 0; i < cluster->active_count; i++)
@@ -633,11 +1729,13 @@ remote_execute(ProxyFunction *func)
 
 		/* check if conn is alive, and launch if not */
 		prepare_conn(func, conn);
-		pending++;
 
 		/* if conn is ready, then send query away */
 		if (conn->cur->state == C_READY)
-			send_query(func, conn, conn->param_values, conn->param_lengths, conn->param_formats);
+			send_query(func, conn);
+
+		if (!cluster->stream || !query_sent(conn))
+			pending++;
 	}
 
 	/* now loop until all results are arrived */
@@ -646,27 +1744,93 @@ remote_execute(ProxyFunction *func)
 		/* allow postgres to cancel processing */
 		CHECK_FOR_INTERRUPTS();
 
-		/* wait for events */
-		if (poll_conns(func, cluster) == 0)
+		check_deadlines(func, cluster);
+
+		/* first partition is slow, ask another one */
+		if (cluster->hedge_time && get_time_ms() >= cluster->hedge_time)
+		{
+			cluster->hedge_time = 0;
+			send_hedge(func);
+		}
+
+		/* PARTIAL: deadline passed, give up on unfinished partitions */
+		if (cluster->partial_time && get_time_ms() >= cluster->partial_time)
+		{
+			cluster->partial_time = 0;
+			for (i = 0; i < cluster->active_count; i++)
+			{
+				conn = cluster->active_list[i];
+				if (conn->run_tag && !conn_finished(conn))
+					skip_conn(func, conn, "not finished in time", NULL, true);
+			}
+		}
+
+		/* wait for events, skipped conns need recheck without them */
+		if (poll_conns(func, cluster) == 0 && !func->partial)
 			continue;
 
-		/* recheck */
-		pending = 0;
-		gettimeofday(&now, NULL);
-		for (i = 0; i < cluster->active_count; i++)
+		/* recheck */
+		pending = 0;
+		done_rows = 0;
+		for (i = 0; i < cluster->active_count; i++)
+		{
+			conn = cluster->active_list[i];
+			if (!conn->run_tag)
+				continue;
+
+			/* login finished, send query */
+			if (conn->cur->state == C_READY && !conn->skipped)
+				send_query(func, conn);
+
+			if (conn->cur->state == C_DONE && conn->query_start && !conn->skipped)
+				update_latency(conn);
+
+			/* streaming: parameters must be sent before SPI_finish() */
+			if (cluster->stream)
+			{
+				if (!query_sent(conn))
+					pending++;
+			}
+			else if (!conn_finished(conn))
+				pending++;
+			else if (!conn->skipped)
+			{
+				if (start && !winner)
+					winner = conn;
+				if (conn->res)
+					done_rows += PQntuples(conn->res);
+			}
+		}
+
+		/* hedging: first answer is enough */
+		if (winner)
+			pending = 0;
+
+		/* LIMIT: enough rows, stop waiting for slower partitions */
+		if (pending && limit_rows >= 0 && done_rows >= limit_rows)
 		{
-			conn = cluster->active_list[i];
-			if (!conn->run_tag)
-				continue;
+			limit_rows = -1;
+			pending = stop_unfinished(func);
+		}
+	}
 
-			/* login finished, send query */
-			if (conn->cur->state == C_READY)
-				send_query(func, conn, conn->param_values, conn->param_lengths, conn->param_formats);
+	/* streaming: rows are fetched by plproxy_stream_fetch() */
+	if (cluster->stream)
+		return;
 
-			if (conn->cur->state != C_DONE)
-				pending++;
+	free_wait_set(cluster);
+	cluster->partial_time = 0;
+
+	if (start)
+	{
+		cluster->hedge_time = 0;
+		add_hedge_sample(cluster, get_time_ms() - start);
 
-			check_timeouts(func, cluster, conn, now.tv_sec);
+		for (i = 0; i < cluster->active_count; i++)
+		{
+			conn = cluster->active_list[i];
+			if (conn->run_tag && winner && conn != winner)
+				drop_hedge_loser(conn);
 		}
 	}
 
@@ -675,6 +1839,21 @@ remote_execute(ProxyFunction *func)
 	{
 		conn = cluster->active_list[i];
 
+		/* PARTIAL, LIMIT: no rows from this one */
+		if (conn->skipped)
+		{
+			conn->run_tag = 0;
+			continue;
+		}
+
+		/* result_memory_limit: rows are already stored */
+		if (cluster->spill)
+		{
+			if (conn->run_tag && conn->cur->state != C_DONE)
+				plproxy_error(func, "Unfinished connection");
+			continue;
+		}
+
 		if ((conn->run_tag || conn->res)
 			&& !(conn->run_tag && conn->res))
 			plproxy_error(func, "run_tag does not match res");
@@ -694,6 +1873,14 @@ remote_execute(ProxyFunction *func)
 
 		cluster->ret_total += PQntuples(conn->res);
 	}
+
+	/* LIMIT: rest of the rows are not returned */
+	if (cluster->ret_limit >= 0 && cluster->ret_total > cluster->ret_limit)
+		cluster->ret_total = cluster->ret_limit;
+
+	/* AGGREGATE: all rows are combined into one */
+	if (func->agg_count > 0)
+		cluster->ret_total = 1;
 }
 
 static void
@@ -703,7 +1890,18 @@ remote_wait_for_cancel(ProxyFunction *func)
 	ProxyCluster *cluster = func->cur_cluster;
 	int			i,
 				pending;
-	struct timeval now;
+
+	/* streaming: forget unreturned rows */
+	for (i = 0; i < cluster->active_count; i++)
+	{
+		conn = cluster->active_list[i];
+		if (conn->res != NULL)
+		{
+			PQclear(conn->res);
+			conn->res = NULL;
+			wait_dirty(conn);
+		}
+	}
 
 	/* now loop until all results are arrived */
 	while (1)
@@ -711,18 +1909,28 @@ remote_wait_for_cancel(ProxyFunction *func)
 		/* allow postgres to cancel processing */
 		CHECK_FOR_INTERRUPTS();
 
+		check_deadlines(func, cluster);
+
 		/* recheck */
 		pending = 0;
-		gettimeofday(&now, NULL);
 		for (i = 0; i < cluster->active_count; i++)
 		{
 			conn = cluster->active_list[i];
 			if (!conn->run_tag)
 				continue;
 
+			/* streaming may have left results in libpq buffer */
+			while (cluster->stream && conn->cur->state == C_QUERY_READ)
+			{
+				drain_conn(func, conn);
+				if (!conn->res)
+					break;
+				PQclear(conn->res);
+				conn->res = NULL;
+			}
+
 			if (conn->cur->state == C_QUERY_READ)
 				pending++;
-			check_timeouts(func, cluster, conn, now.tv_sec);
 		}
 		if (!pending)
 			break;
@@ -752,46 +1960,14 @@ remote_wait_for_cancel(ProxyFunction *func)
 static void
 remote_cancel(ProxyFunction *func)
 {
-	ProxyConnection *conn;
 	ProxyCluster *cluster = func->cur_cluster;
-	PGcancel *cancel;
-	char errbuf[256];
-	int ret;
 	int i;
 
 	if (cluster == NULL)
 		return;
 
 	for (i = 0; i < cluster->active_count; i++)
-	{
-		conn = cluster->active_list[i];
-		switch (conn->cur->state)
-		{
-			case C_NONE:
-			case C_READY:
-			case C_DONE:
-				break;
-			case C_QUERY_WRITE:
-			case C_CONNECT_READ:
-			case C_CONNECT_WRITE:
-				plproxy_disconnect(conn->cur);
-				break;
-			case C_QUERY_READ:
-				cancel = PQgetCancel(conn->cur->db);
-				if (cancel == NULL)
-				{
-					elog(NOTICE, "Invalid connection!");
-					continue;
-				}
-				ret = PQcancel(cancel, errbuf, sizeof(errbuf));
-				PQfreeCancel(cancel);
-				if (ret == 0)
-					elog(NOTICE, "Cancel query failed!");
-				else
-					conn->cur->waitCancel = 1;
-				break;
-		}
-	}
+		cancel_conn(cluster->active_list[i]);
 
 	remote_wait_for_cancel(func);
 }
@@ -800,26 +1976,233 @@ remote_cancel(ProxyFunction *func)
  * Tag & move tagged connections to active list
  */
 
-static void tag_part(struct ProxyCluster *cluster, int64 hash, int tag)
+/*
+ * READONLY: pick connection from partition replicas.
+ *
+ * Partition that is already tagged in current call
+ * keeps its connection.
+ */
+static ProxyConnection *
+select_replica(ProxyCluster *cluster, int idx)
 {
+	ProxyReplicaSet *set = &cluster->replica_map[idx];
 	ProxyConnection *conn;
-	int64 idx;
+	int			i;
+
+	for (i = 0; i < set->count; i++)
+	{
+		if (set->conns[i]->run_tag)
+			return set->conns[i];
+	}
+
+	if (cluster->config.replica_selection == REPLICA_LEAST_LATENCY)
+	{
+		conn = set->conns[0];
+		for (i = 1; i < set->count; i++)
+		{
+			if (set->conns[i]->latency < conn->latency)
+				conn = set->conns[i];
+		}
+		return conn;
+	}
+
+	conn = set->conns[set->next];
+	set->next = (set->next + 1) % set->count;
+	return conn;
+}
+
+/* map hash to partition index, via bucket if cluster has bucket map */
+static int hash_to_part(ProxyCluster *cluster, int64 hash)
+{
+	int			count = cluster->bucket_map ? cluster->bucket_count : cluster->part_count;
+	int			idx;
 
-	/* map hash to connection index */
 	if (cluster->config.modular_mapping) {
 		if (hash < 0)
-			idx = -(hash % cluster->part_count);
+			idx = -(hash % count);
 		else
-			idx = hash % cluster->part_count;
+			idx = hash % count;
 	} else {
-		idx = hash & cluster->part_mask;
+		idx = hash & (cluster->bucket_map ? cluster->bucket_mask : cluster->part_mask);
+	}
+
+	return cluster->bucket_map ? cluster->bucket_map[idx] : idx;
+}
+
+/* connection to use for partition */
+static ProxyConnection *part_conn(ProxyFunction *func, int idx)
+{
+	ProxyCluster *cluster = func->cur_cluster;
+
+	if (func->read_only && cluster->replica_map && cluster->replica_map[idx].count > 0)
+		return select_replica(cluster, idx);
+	return cluster->part_map[idx];
+}
+
+/*
+ * SPLIT: rows of split arrays and connections they go to,
+ * filled while tagging, arrays are built from it at the end.
+ */
+typedef struct SplitMap
+{
+	int		   *rows;			/* Array row */
+	int		   *conns;			/* Connection position in active_list */
+	int			count;
+	int			alloc;
+} SplitMap;
+
+static void split_map_add(SplitMap *map, int row, int pos)
+{
+	if (map->count >= map->alloc)
+	{
+		map->alloc = map->alloc ? map->alloc * 2 : 64;
+		if (map->rows)
+		{
+			map->rows = repalloc(map->rows, map->alloc * sizeof(int));
+			map->conns = repalloc(map->conns, map->alloc * sizeof(int));
+		}
+		else
+		{
+			map->rows = palloc(map->alloc * sizeof(int));
+			map->conns = palloc(map->alloc * sizeof(int));
+		}
 	}
-	conn = cluster->part_map[idx];
+	map->rows[map->count] = row;
+	map->conns[map->count] = pos;
+	map->count++;
+}
+
+/*
+ * Tag connection for partition.  With SPLIT, tag is row + 1
+ * and the row is added to map once per connection.
+ */
+static void tag_part(ProxyFunction *func, int idx, int tag, SplitMap *map)
+{
+	ProxyCluster *cluster = func->cur_cluster;
+	ProxyConnection *conn;
 
+	conn = part_conn(func, idx);
 	if (!conn->run_tag)
+	{
 		plproxy_activate_connection(conn);
+		conn->split_pos = cluster->active_count - 1;
+	}
+	else if (conn->run_tag == tag)
+		return;
 
 	conn->run_tag = tag;
+	if (map)
+		split_map_add(map, tag - 1, conn->split_pos);
+}
+
+/*
+ * Call hash function directly, without SPI.
+ * It is strict, so NULL argument gives NULL hash.
+ */
+static int64
+call_hash_direct(ProxyFunction *func, FunctionCallInfo fcinfo,
+				 DatumArray **array_params, int array_row)
+{
+	Datum		args[3];
+	Datum		val;
+	int			i,
+				idx;
+
+	for (i = 0; i < func->hash_fn_nargs; i++)
+	{
+		idx = func->hash_fn_args[i];
+		if (PG_ARGISNULL(idx))
+			plproxy_error(func, "Hash function returned NULL");
+		else if (array_params && IS_SPLIT_ARG(func, idx))
+		{
+			if (array_params[idx]->nulls[array_row])
+				plproxy_error(func, "Hash function returned NULL");
+			args[i] = array_params[idx]->values[array_row];
+		}
+		else
+			args[i] = PG_GETARG_DATUM(idx);
+	}
+
+	switch (func->hash_fn_nargs)
+	{
+		case 1:
+			val = FunctionCall1Coll(&func->hash_finfo, func->hash_collation, args[0]);
+			break;
+		case 2:
+			val = FunctionCall2Coll(&func->hash_finfo, func->hash_collation, args[0], args[1]);
+			break;
+		default:
+			val = FunctionCall3Coll(&func->hash_finfo, func->hash_collation,
+									args[0], args[1], args[2]);
+			break;
+	}
+
+	if (func->hash_rettype == INT4OID)
+		return DatumGetInt32(val);
+	else if (func->hash_rettype == INT8OID)
+		return DatumGetInt64(val);
+	return DatumGetInt16(val);
+}
+
+/*
+ * Find partition for RUN ON RANGE key by binary search over
+ * lower bounds of partitions 1..N-1.
+ */
+static int
+range_to_part(ProxyFunction *func, FunctionCallInfo fcinfo,
+			  DatumArray **array_params, int array_row)
+{
+	ProxyCluster *cluster = func->cur_cluster;
+	int			idx = func->range_arg;
+	Oid			typid;
+	Datum		key;
+	int			lo,
+				hi,
+				mid;
+
+	if (PG_ARGISNULL(idx))
+		plproxy_error(func, "RANGE key is NULL");
+	if (array_params && IS_SPLIT_ARG(func, idx))
+	{
+		if (array_params[idx]->nulls[array_row])
+			plproxy_error(func, "RANGE key is NULL");
+		key = array_params[idx]->values[array_row];
+		typid = array_params[idx]->type->type_oid;
+	}
+	else
+	{
+		key = PG_GETARG_DATUM(idx);
+		typid = func->arg_types[idx]->type_oid;
+	}
+
+	plproxy_range_prepare(func, cluster, typid);
+
+	/* first bound that is > key, partition before it holds key */
+	lo = 0;
+	hi = cluster->range_count;
+	while (lo < hi)
+	{
+		mid = (lo + hi) / 2;
+		if (DatumGetInt32(FunctionCall2Coll(cluster->range_cmp, cluster->range_collation,
+											cluster->range_values[mid], key)) <= 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/*
+ * Direct call skips permission check that SPI does, so check
+ * EXECUTE for current user on each call, it may have changed
+ * with SET ROLE or SECURITY DEFINER.  Without permission
+ * the SPI path is used and it reports the error.
+ */
+static bool
+use_hash_direct(ProxyFunction *func)
+{
+	return func->hash_direct
+		&& pg_proc_aclcheck(func->hash_finfo.fn_oid, GetUserId(), ACL_EXECUTE) == ACLCHECK_OK;
 }
 
 /*
@@ -829,12 +2212,20 @@ static void tag_part(struct ProxyCluster *cluster, int64 hash, int tag)
  */
 static void
 tag_hash_partitions(ProxyFunction *func, FunctionCallInfo fcinfo, int tag,
-					DatumArray **array_params, int array_row)
+					DatumArray **array_params, int array_row, SplitMap *map)
 {
 	int			i;
 	TupleDesc	desc;
 	Oid			htype;
-	ProxyCluster *cluster = func->cur_cluster;
+
+	/* common case, single hash value from immutable function */
+	if (use_hash_direct(func))
+	{
+		tag_part(func, hash_to_part(func->cur_cluster,
+									call_hash_direct(func, fcinfo, array_params, array_row)),
+				 tag, map);
+		return;
+	}
 
 	/* execute cached plan */
 	plproxy_query_exec(func, fcinfo, func->hash_sql, array_params, array_row);
@@ -863,7 +2254,7 @@ tag_hash_partitions(ProxyFunction *func, FunctionCallInfo fcinfo, int tag,
 		else
 			plproxy_error(func, "Hash result must be int2, int4 or int8");
 
-		tag_part(cluster, hashval, tag);
+		tag_part(func, hash_to_part(func->cur_cluster, hashval), tag, map);
 	}
 
 	/* sanity check */
@@ -902,7 +2293,7 @@ make_datum_array(ProxyFunction *func, ArrayType *v, ProxyType *array_type)
  */
 static void
 tag_run_on_partitions(ProxyFunction *func, FunctionCallInfo fcinfo, int tag,
-					  DatumArray **array_params, int array_row)
+					  DatumArray **array_params, int array_row, SplitMap *map)
 {
 	ProxyCluster   *cluster = func->cur_cluster;
 	int				i;
@@ -910,26 +2301,137 @@ tag_run_on_partitions(ProxyFunction *func, FunctionCallInfo fcinfo, int tag,
 	switch (func->run_type)
 	{
 		case R_HASH:
-			tag_hash_partitions(func, fcinfo, tag, array_params, array_row);
+			tag_hash_partitions(func, fcinfo, tag, array_params, array_row, map);
 			break;
 		case R_ALL:
 			for (i = 0; i < cluster->part_count; i++)
-				tag_part(cluster, i, tag);
+				tag_part(func, i, tag, map);
 			break;
 		case R_EXACT:
 			i = func->exact_nr;
 			if (i < 0 || i >= cluster->part_count)
 				plproxy_error(func, "part number out of range");
-			tag_part(cluster, i, tag);
+			tag_part(func, i, tag, map);
 			break;
 		case R_ANY:
-			tag_part(cluster, plproxy_random(), tag);
+			tag_part(func, plproxy_random() % cluster->part_count, tag, map);
+			break;
+		case R_RANGE:
+			tag_part(func, range_to_part(func, fcinfo, array_params, array_row), tag, map);
 			break;
 		default:
 			plproxy_error(func, "uninitialized run_type");
 	}
 }
 
+/*
+ * SPLIT with directly called hash function or RUN ON RANGE:
+ * connection for each row, one replica per partition.
+ */
+static void
+split_direct(ProxyFunction *func, FunctionCallInfo fcinfo,
+			 DatumArray **arrays, int nrows, SplitMap *map)
+{
+	ProxyCluster *cluster = func->cur_cluster;
+	ProxyConnection **part_conns;
+	ProxyConnection *conn;
+	int			row,
+				idx;
+
+	part_conns = palloc0(cluster->part_count * sizeof(*part_conns));
+	map->rows = palloc(nrows * sizeof(int));
+	map->conns = palloc(nrows * sizeof(int));
+	map->alloc = nrows;
+
+	for (row = 0; row < nrows; row++)
+	{
+		if (func->run_type == R_RANGE)
+			idx = range_to_part(func, fcinfo, arrays, row);
+		else
+			idx = hash_to_part(cluster, call_hash_direct(func, fcinfo, arrays, row));
+		conn = part_conns[idx];
+		if (!conn)
+		{
+			conn = part_conn(func, idx);
+			if (!conn->run_tag)
+			{
+				plproxy_activate_connection(conn);
+				conn->split_pos = cluster->active_count - 1;
+				conn->run_tag = 1;
+			}
+			part_conns[idx] = conn;
+		}
+		map->rows[row] = row;
+		map->conns[row] = conn->split_pos;
+	}
+	map->count = nrows;
+}
+
+/*
+ * Build split arrays for each tagged connection.
+ *
+ * Map entries are grouped by connection first, so each
+ * array is constructed at once from its elements.
+ */
+static void
+build_split_arrays(ProxyFunction *func, DatumArray **arrays, SplitMap *map)
+{
+	ProxyCluster *cluster = func->cur_cluster;
+	ProxyConnection *conn;
+	DatumArray *da;
+	Datum	   *values;
+	bool	   *nulls;
+	int		   *end,
+			   *order;
+	int			i,
+				k,
+				col,
+				start,
+				count,
+				lbound = 1;
+
+	/* counting sort by connection, end[i] is end of group i */
+	end = palloc0(cluster->active_count * sizeof(int));
+	for (i = 0; i < map->count; i++)
+		end[map->conns[i]]++;
+	for (i = 1; i < cluster->active_count; i++)
+		end[i] += end[i - 1];
+	order = palloc(map->count * sizeof(int));
+	for (i = map->count - 1; i >= 0; i--)
+		order[--end[map->conns[i]]] = map->rows[i];
+
+	/* now end[i] is start of group i */
+	values = palloc(map->count * sizeof(Datum));
+	nulls = palloc(map->count * sizeof(bool));
+	for (i = 0; i < cluster->active_count; i++)
+	{
+		conn = cluster->active_list[i];
+		start = end[i];
+		count = (i + 1 < cluster->active_count ? end[i + 1] : map->count) - start;
+
+		conn->split_params = palloc(func->arg_count * sizeof(*conn->split_params));
+		for (col = 0; col < func->arg_count; col++)
+		{
+			if (!IS_SPLIT_ARG(func, col))
+			{
+				conn->split_params[col] = PointerGetDatum(NULL);
+				continue;
+			}
+
+			da = arrays[col];
+			for (k = 0; k < count; k++)
+			{
+				values[k] = da->values[order[start + k]];
+				nulls[k] = da->nulls[order[start + k]];
+			}
+			conn->split_params[col] = PointerGetDatum(
+				construct_md_array(values, nulls, 1, &count, &lbound,
+								   da->type->type_oid, da->type->length,
+								   da->type->by_value, da->type->alignment));
+		}
+	}
+}
+
 /*
  * Tag the partitions to be run on, if split is requested prepare the
  * per-partition split array parameters.
@@ -941,11 +2443,11 @@ tag_run_on_partitions(ProxyFunction *func, FunctionCallInfo fcinfo, int tag,
 static void
 prepare_and_tag_partitions(ProxyFunction *func, FunctionCallInfo fcinfo)
 {
-	int					i, row, col;
+	int					i, row;
 	int					split_array_len = -1;
 	int					split_array_count = 0;
-	ProxyCluster	   *cluster = func->cur_cluster;
 	DatumArray		   *arrays_to_split[FUNC_MAX_ARGS];
+	SplitMap			map;
 
 	/*
 	 * See if we have any arrays to split. If so, make them manageable by
@@ -986,132 +2488,126 @@ prepare_and_tag_partitions(ProxyFunction *func, FunctionCallInfo fcinfo)
 	/* If nothing to split, just tag the partitions and be done with it */
 	if (!split_array_count)
 	{
-		tag_run_on_partitions(func, fcinfo, 1, NULL, 0);
+		tag_run_on_partitions(func, fcinfo, 1, NULL, 0, NULL);
 		return;
 	}
+	memset(&map, 0, sizeof(map));
 
-	/* Need to split, evaluate the RUN ON condition for each of the elements. */
-	for (row = 0; row < split_array_len; row++)
+	/*
+	 * Need to split, evaluate the RUN ON condition for each of the elements.
+	 * Common case does not need to go through SPI for each row.
+	 */
+	if ((func->run_type == R_HASH && use_hash_direct(func)) || func->run_type == R_RANGE)
+		split_direct(func, fcinfo, arrays_to_split, split_array_len, &map);
+	else
 	{
-		int		part;
-		int		my_tag = row+1;
-
-		/*
-		 * Tag the run-on partitions with a tag that allows us us to identify
-		 * which partitions need the set of elements from this row.
-		 */
-		tag_run_on_partitions(func, fcinfo, my_tag, arrays_to_split, row);
-
-		/* Add the array elements to the partitions tagged in previous step */
-		for (part = 0; part < cluster->active_count; part++)
-		{
-			ProxyConnection	   *conn = cluster->active_list[part];
+		for (row = 0; row < split_array_len; row++)
+			tag_run_on_partitions(func, fcinfo, row + 1, arrays_to_split, row, &map);
+	}
 
-			if (conn->run_tag != my_tag)
-				continue;
+	build_split_arrays(func, arrays_to_split, &map);
+}
 
-			if (!conn->bstate)
-				conn->bstate = palloc0(func->arg_count * sizeof(*conn->bstate));
+/*
+ * Prepare parameters for the query.  They are encoded
+ * in send_query(), when it is known whether connection
+ * can use binary I/O.
+ */
+static void
+prepare_query_parameters(ProxyFunction *func, FunctionCallInfo fcinfo)
+{
+	ProxyCluster *cluster = func->cur_cluster;
+	ProxyParam *p;
+	int			i,
+				idx;
 
-			/* Add this set of elements to the partition specific arrays */
-			for (col = 0; col < func->arg_count; col++)
-			{
-				if (!IS_SPLIT_ARG(func, col))
-					continue;
-
-				conn->bstate[col] = accumArrayResult(conn->bstate[col],
-													 arrays_to_split[col]->values[row],
-													 arrays_to_split[col]->nulls[row],
-													 arrays_to_split[col]->type->type_oid,
-													 CurrentMemoryContext);
-			}
-		}
+	cluster->params = palloc0(func->remote_sql->arg_count * sizeof(ProxyParam));
+	for (i = 0; i < func->remote_sql->arg_count; i++)
+	{
+		idx = func->remote_sql->arg_lookup[i];
+		p = &cluster->params[i];
+		p->isnull = PG_ARGISNULL(idx);
+		p->split = IS_SPLIT_ARG(func, idx);
+		if (!p->isnull && !p->split)
+			p->value = PG_GETARG_DATUM(idx);
 	}
+}
 
-	/*
-	 * Finally, copy the accumulated arrays to the actual connections
-	 * to be used as parameters.
-	 */
-	for (i = 0; i < cluster->active_count; i++)
-	{
-		ProxyConnection *conn = cluster->active_list[i];
+/*
+ * Clusters with unfinished streams.
+ */
+static ProxyCluster *stream_list;
 
-		if (!conn->run_tag)
-			continue;
+static void
+stream_start(ProxyCluster *cluster)
+{
+	cluster->stream = true;
+	cluster->stream_subxact = GetCurrentSubTransactionId();
+	cluster->stream_next = stream_list;
+	stream_list = cluster;
+}
 
-		conn->split_params = palloc(func->arg_count * sizeof(*conn->split_params));
+static void
+stream_stop(ProxyCluster *cluster)
+{
+	ProxyCluster **p;
 
-		for (col = 0; col < func->arg_count; col++)
+	for (p = &stream_list; *p; p = &(*p)->stream_next)
+	{
+		if (*p == cluster)
 		{
-			if (!IS_SPLIT_ARG(func, col))
-				conn->split_params[col] = PointerGetDatum(NULL);
-			else
-				conn->split_params[col] = makeArrayResult(conn->bstate[col],
-														  CurrentMemoryContext);
+			*p = cluster->stream_next;
+			break;
 		}
 	}
+	cluster->stream_next = NULL;
+	cluster->stream = false;
+	cluster->busy = false;
 }
 
 /*
- * Prepare parameters for the query.
+ * Drop streams started in aborted (sub)transaction.
+ *
+ * Unfinished connections are closed, it is not
+ * safe to wait for cancel here.
  */
 static void
-prepare_query_parameters(ProxyFunction *func, FunctionCallInfo fcinfo)
+stream_abort(SubTransactionId subid)
 {
-	int				i;
-	ProxyCluster   *cluster = func->cur_cluster;
+	ProxyCluster *cluster,
+			   *next;
+	ProxyConnection *conn;
+	int			i;
 
-	for (i = 0; i < func->remote_sql->arg_count; i++)
+	for (cluster = stream_list; cluster; cluster = next)
 	{
-		int			idx = func->remote_sql->arg_lookup[i];
-		bool		bin = cluster->config.disable_binary ? 0 : 1;
-		const char *fixed_param_val = NULL;
-		int			fixed_param_len, fixed_param_fmt;
-		int			part;
+		next = cluster->stream_next;
+		if (subid != InvalidSubTransactionId && cluster->stream_subxact < subid)
+			continue;
 
-		/* Avoid doing multiple conversions for fixed parameters */
-		if (!IS_SPLIT_ARG(func, idx) && !PG_ARGISNULL(idx))
+		for (i = 0; i < cluster->active_count; i++)
 		{
-			fixed_param_val = plproxy_send_type(func->arg_types[idx],
-												PG_GETARG_DATUM(idx),
-												bin,
-												&fixed_param_len,
-												&fixed_param_fmt);
+			conn = cluster->active_list[i];
+			if (conn->cur->state != C_DONE)
+				plproxy_disconnect(conn->cur);
 		}
+		plproxy_clean_results(cluster);
+	}
+}
 
-		/* Add the parameters to partitions */
-		for (part = 0; part < cluster->active_count; part++)
-		{
-			ProxyConnection *conn = cluster->active_list[part];
-
-			if (!conn->run_tag)
-				continue;
+static void
+stream_xact_callback(XactEvent event, void *arg)
+{
+	if (event == XACT_EVENT_ABORT)
+		stream_abort(InvalidSubTransactionId);
+}
 
-			if (PG_ARGISNULL(idx))
-			{
-				conn->param_values[i] = NULL;
-				conn->param_lengths[i] = 0;
-				conn->param_formats[i] = 0;
-			}
-			else
-			{
-				if (IS_SPLIT_ARG(func, idx))
-				{
-					conn->param_values[i] = plproxy_send_type(func->arg_types[idx],
-															  conn->split_params[idx],
-															  bin,
-															  &conn->param_lengths[i],
-															  &conn->param_formats[i]);
-				}
-				else
-				{
-					conn->param_values[i] = fixed_param_val;
-					conn->param_lengths[i] = fixed_param_len;
-					conn->param_formats[i] = fixed_param_fmt;
-				}
-			}
-		}
-	}
+static void
+stream_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+						SubTransactionId parentSubid, void *arg)
+{
+	if (event == SUBXACT_EVENT_ABORT_SUB)
+		stream_abort(mySubid);
 }
 
 /* Clean old results and prepare for new one */
@@ -1126,6 +2622,24 @@ plproxy_clean_results(ProxyCluster *cluster)
 
 	cluster->ret_total = 0;
 	cluster->ret_cur_conn = 0;
+	cluster->deadline_count = 0;
+	cluster->hedge_time = 0;
+	cluster->partial_time = 0;
+	cluster->ret_limit = -1;
+	cluster->merge_count = 0;
+	cluster->merge_init = false;
+	cluster->params = NULL;
+	if (cluster->merge_ctx)
+		MemoryContextReset(cluster->merge_ctx);
+
+	/* not given to executor, release temp files */
+	if (cluster->spill_store)
+		tuplestore_end(cluster->spill_store);
+	cluster->spill_store = NULL;
+	cluster->spill_desc = NULL;
+	cluster->spill = false;
+	if (cluster->spill_ctx)
+		MemoryContextReset(cluster->spill_ctx);
 
 	for (i = 0; i < cluster->active_count; i++)
 	{
@@ -1136,8 +2650,10 @@ plproxy_clean_results(ProxyCluster *cluster)
 			conn->res = NULL;
 		}
 		conn->pos = 0;
+		conn->deadline = 0;
+		conn->query_start = 0;
+		conn->skipped = false;
 		conn->run_tag = 0;
-		conn->bstate = NULL;
 		conn->cur = NULL;
 		cluster->active_list[i] = NULL;
 	}
@@ -1145,6 +2661,11 @@ plproxy_clean_results(ProxyCluster *cluster)
 	/* reset active_list */
 	cluster->active_count = 0;
 
+	if (cluster->stream)
+		stream_stop(cluster);
+
+	free_wait_set(cluster);
+
 	/* conn state checks are done in prepare_conn */
 }
 
@@ -1161,6 +2682,68 @@ void plproxy_disconnect(ProxyConnectionState *cur)
 	cur->same_ver = 0;
 	cur->tuning = 0;
 	cur->waitCancel = 0;
+	cur->tuning_results = 0;
+	plproxy_drop_prepared(cur);
+	cur->stmt_seq = 0;
+}
+
+/* LIMIT value for current call, -1 if none */
+static int64
+get_limit(ProxyFunction *func, FunctionCallInfo fcinfo)
+{
+	int64		limit;
+	int			idx = func->limit_arg;
+
+	if (!func->has_limit)
+		return -1;
+	if (idx < 0)
+		return func->limit_value;
+
+	/* NULL means no limit, like in SQL */
+	if (PG_ARGISNULL(idx))
+		return -1;
+
+	switch (func->arg_types[idx]->type_oid)
+	{
+		case INT2OID:
+			limit = DatumGetInt16(PG_GETARG_DATUM(idx));
+			break;
+		case INT4OID:
+			limit = DatumGetInt32(PG_GETARG_DATUM(idx));
+			break;
+		default:
+			limit = DatumGetInt64(PG_GETARG_DATUM(idx));
+			break;
+	}
+	if (limit < 0)
+		plproxy_error(func, "LIMIT must not be negative");
+	return limit;
+}
+
+/*
+ * result_memory_limit: store rows while they arrive, if the result
+ * will be materialized anyway and nothing needs all results at once.
+ */
+static bool
+can_spill(ProxyFunction *func, FunctionCallInfo fcinfo)
+{
+	ReturnSetInfo *rsi = (ReturnSetInfo *) fcinfo->resultinfo;
+	ProxyCluster *cluster = func->cur_cluster;
+
+	if (cluster->config.result_memory_limit <= 0 || !fcinfo->flinfo->fn_retset)
+		return false;
+	if (!rsi || !IsA(rsi, ReturnSetInfo) || !(rsi->allowedModes & SFRM_Materialize))
+		return false;
+
+	/* these look at all results after execution */
+	if (func->partial || func->order_count > 0 || func->agg_count > 0 || func->has_limit)
+		return false;
+
+	/* hedging may throw away rows of the losing partition */
+	if (can_hedge(func, cluster))
+		return false;
+
+	return true;
 }
 
 /* Select partitions and execute query on them */
@@ -1179,6 +2762,18 @@ plproxy_exec(ProxyFunction *func, FunctionCallInfo fcinfo)
 		/* clean old results */
 		plproxy_clean_results(func->cur_cluster);
 
+		func->cur_cluster->ret_limit = get_limit(func, fcinfo);
+
+		/*
+		 * Set-returning functions can fetch rows on demand,
+		 * except PARTIAL and AGGREGATE.
+		 */
+		if (fcinfo->flinfo->fn_retset && func->cur_cluster->config.stream_chunk_size > 0
+			&& !func->partial && func->agg_count == 0)
+			stream_start(func->cur_cluster);
+		else if (can_spill(func, fcinfo))
+			plproxy_spill_start(func, fcinfo);
+
 		/* tag the partitions and prepare per-partition parameters */
 		prepare_and_tag_partitions(func, fcinfo);
 
@@ -1187,7 +2782,9 @@ plproxy_exec(ProxyFunction *func, FunctionCallInfo fcinfo)
 
 		remote_execute(func);
 
-		func->cur_cluster->busy = false;
+		/* streaming keeps cluster busy until all rows are returned */
+		if (!func->cur_cluster->stream)
+			func->cur_cluster->busy = false;
 	}
 	PG_CATCH();
 	{
@@ -1204,3 +2801,291 @@ plproxy_exec(ProxyFunction *func, FunctionCallInfo fcinfo)
 	PG_END_TRY();
 }
 
+/*
+ * Streaming: wait until some connection has rows to return.
+ * Without ORDER BY, chunk that arrived first is returned first,
+ * so slow partition does not hold back rows of others.
+ * ORDER BY merge needs next rows from all connections.
+ *
+ * Returns false when all connections are finished.
+ */
+static bool
+remote_stream_wait(ProxyFunction *func)
+{
+	ProxyConnection *conn;
+	ProxyCluster *cluster = func->cur_cluster;
+	int			i,
+				pending,
+				ready,
+				best = 0;
+
+	while (1)
+	{
+		check_deadlines(func, cluster);
+
+		pending = 0;
+		ready = 0;
+		for (i = 0; i < cluster->active_count; i++)
+		{
+			conn = cluster->active_list[i];
+			if (!conn->run_tag)
+				continue;
+
+			/* release returned chunk, wait time starts again */
+			if (conn->res && conn->pos == PQntuples(conn->res))
+			{
+				PQclear(conn->res);
+				conn->res = NULL;
+				conn->pos = 0;
+				wait_dirty(conn);
+				if (conn->cur->state != C_DONE)
+					set_deadline(cluster, conn, cluster->config.query_timeout);
+			}
+
+			/* rest may be already buffered */
+			if (!conn->res && conn->cur->state == C_QUERY_READ)
+				drain_conn(func, conn);
+
+			if (conn->res)
+			{
+				/* oldest chunk first, rows are returned in arrival order */
+				if (!ready || conn->res_seq < cluster->active_list[best]->res_seq)
+					best = i;
+				ready++;
+			}
+			else if (conn->cur->state != C_DONE)
+				pending++;
+		}
+
+		/* without merge, any partition with rows will do */
+		if (ready && func->order_count == 0)
+		{
+			cluster->ret_cur_conn = best;
+			return true;
+		}
+		if (!pending)
+			return ready > 0;
+
+		/* allow postgres to cancel processing */
+		CHECK_FOR_INTERRUPTS();
+
+		/* wait for events */
+		poll_conns(func, cluster);
+	}
+}
+
+/*
+ * Streaming: make sure next row is available for plproxy_result().
+ *
+ * Returns false when there are no more rows.
+ */
+bool
+plproxy_stream_fetch(ProxyFunction *func)
+{
+	bool		found = false;
+
+	PG_TRY();
+	{
+		/* LIMIT: enough rows returned, stop partitions */
+		if (func->cur_cluster->ret_limit == 0)
+			remote_cancel(func);
+		else
+			found = remote_stream_wait(func);
+	}
+	PG_CATCH();
+	{
+		if (geterrcode() == ERRCODE_QUERY_CANCELED)
+			remote_cancel(func);
+
+		plproxy_clean_results(func->cur_cluster);
+
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	return found;
+}
+
+/*
+ * Streaming was stopped before all rows were returned,
+ * cancel remote queries.
+ */
+void
+plproxy_stream_cancel(ProxyFunction *func)
+{
+	ProxyCluster *cluster = func->cur_cluster;
+
+	if (!cluster || !cluster->stream || cluster->cur_func != func)
+		return;
+
+	PG_TRY();
+	{
+		remote_cancel(func);
+	}
+	PG_CATCH();
+	{
+		plproxy_clean_results(cluster);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	plproxy_clean_results(cluster);
+}
+
+/*
+ * Prewarm: connection is ready when login and tuning are done.
+ *
+ * Returns true if conn still needs work.
+ */
+static bool
+prewarm_step(ProxyFunction *func, ProxyConnection *conn, int64 start)
+{
+	struct timeval now;
+
+	if (conn->cur->state != C_READY)
+		return true;
+
+	/* login finished, send tuning query if needed */
+	if (!conn->cur->tuning)
+	{
+		gettimeofday(&now, NULL);
+		conn->cur->query_time = now.tv_sec;
+		set_deadline(func->cur_cluster, conn, func->cur_cluster->config.query_timeout);
+		if (tune_connection(func, conn, tuning_queries(func, conn)))
+			return true;
+	}
+
+	/* done, stop watching it */
+	conn->cur->tuning = 0;
+	conn->deadline = 0;
+	conn->run_tag = 0;
+	if (conn->connect_ms >= 0)
+		conn->connect_ms = get_time_ms() - start;
+	return false;
+}
+
+/* Connect to all tagged connections in parallel */
+static void
+remote_prewarm(ProxyFunction *func)
+{
+	ProxyConnection *conn;
+	ProxyCluster *cluster = func->cur_cluster;
+	int64		start = get_time_ms();
+	int			i,
+				pending = 0;
+
+	for (i = 0; i < cluster->active_count; i++)
+	{
+		conn = cluster->active_list[i];
+
+		/* existing conn is checked and kept, otherwise new one launched */
+		prepare_conn(func, conn);
+		conn->connect_ms = (conn->cur->state == C_READY) ? -1 : 0;
+
+		if (prewarm_step(func, conn, start))
+			pending++;
+	}
+
+	while (pending)
+	{
+		/* allow postgres to cancel processing */
+		CHECK_FOR_INTERRUPTS();
+
+		check_deadlines(func, cluster);
+
+		/* wait for events */
+		if (poll_conns(func, cluster) == 0)
+			continue;
+
+		/* recheck */
+		pending = 0;
+		for (i = 0; i < cluster->active_count; i++)
+		{
+			conn = cluster->active_list[i];
+			if (!conn->run_tag)
+				continue;
+
+			if (prewarm_step(func, conn, start))
+				pending++;
+		}
+	}
+
+	free_wait_set(cluster);
+}
+
+/*
+ * Open and tune connections to all partitions
+ * of func->cur_cluster for current user.
+ *
+ * Connect time is left in conn->connect_ms, caller
+ * must call plproxy_clean_results() after reading it.
+ */
+void
+plproxy_prewarm_cluster(ProxyFunction *func)
+{
+	ProxyCluster *cluster = func->cur_cluster;
+	ProxyConnection *conn;
+	int			i;
+
+	PG_TRY();
+	{
+		cluster->busy = true;
+		cluster->cur_func = func;
+
+		/* clean old results */
+		plproxy_clean_results(cluster);
+
+		/* tag each connection once */
+		for (i = 0; i < cluster->part_count; i++)
+		{
+			conn = cluster->part_map[i];
+			if (!conn->run_tag)
+				plproxy_activate_connection(conn);
+			conn->run_tag = 1;
+		}
+
+		/* replicas too */
+		for (i = 0; i < cluster->part_count && cluster->replica_map; i++)
+		{
+			ProxyReplicaSet *set = &cluster->replica_map[i];
+			int			j;
+
+			for (j = 0; j < set->count; j++)
+			{
+				conn = set->conns[j];
+				if (!conn->run_tag)
+					plproxy_activate_connection(conn);
+				conn->run_tag = 1;
+			}
+		}
+
+		remote_prewarm(func);
+
+		cluster->busy = false;
+	}
+	PG_CATCH();
+	{
+		cluster->busy = false;
+
+		/* drop half-open connections */
+		for (i = 0; i < cluster->active_count; i++)
+		{
+			conn = cluster->active_list[i];
+			if (conn->run_tag)
+				plproxy_disconnect(conn->cur);
+		}
+
+		plproxy_clean_results(cluster);
+
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+}
+
+/* One-time initialization */
+void
+plproxy_exec_init(void)
+{
+	RegisterXactCallback(stream_xact_callback, NULL);
+	RegisterSubXactCallback(stream_subxact_callback, NULL);
+}
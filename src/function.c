@@ -25,7 +25,6 @@
 
 #include "plproxy.h"
 
-
 /*
  * Function cache entry.
  *
@@ -52,6 +51,12 @@ static HTAB *fn_cache = NULL;
  */
 static ProxyFunction *partial_func = NULL;
 
+/*
+ * Source for ProxyFunction->result_rev, connections use it
+ * to tell apart result mappings of different functions.
+ */
+static int	result_rev_seq = 0;
+
 
 
 /* Allocate memory in the function's context */
@@ -149,6 +154,82 @@ plproxy_split_all_arrays(ProxyFunction *func)
 	}
 }
 
+/* Add ORDER BY column, by name or 1-based position */
+void
+plproxy_order_add(ProxyFunction *func, const char *name, int position)
+{
+	ProxyOrderKey *key;
+	int			n = func->order_count + 1;
+
+	if (func->order_keys)
+		func->order_keys = repalloc(func->order_keys, n * sizeof(ProxyOrderKey));
+	else
+		func->order_keys = plproxy_func_alloc(func, sizeof(ProxyOrderKey));
+
+	key = &func->order_keys[func->order_count++];
+	memset(key, 0, sizeof(*key));
+	key->name = name ? plproxy_func_strdup(func, name) : NULL;
+	key->position = position;
+	key->attno = -1;
+}
+
+/* Set direction of last ORDER BY column */
+bool
+plproxy_order_set_dir(ProxyFunction *func, const char *dir)
+{
+	ProxyOrderKey *key = &func->order_keys[func->order_count - 1];
+
+	if (pg_strcasecmp(dir, "desc") == 0)
+		key->desc = true;
+	else if (pg_strcasecmp(dir, "asc") != 0)
+		return false;
+	return true;
+}
+
+/* Add AGGREGATE column, by name or 1-based position */
+void
+plproxy_aggregate_add(ProxyFunction *func, const char *aggname,
+					  const char *name, int position)
+{
+	ProxyAggregate *agg;
+	int			n = func->agg_count + 1;
+
+	if (func->aggs)
+		func->aggs = repalloc(func->aggs, n * sizeof(ProxyAggregate));
+	else
+		func->aggs = plproxy_func_alloc(func, sizeof(ProxyAggregate));
+
+	agg = &func->aggs[func->agg_count++];
+	memset(agg, 0, sizeof(*agg));
+	agg->aggname = plproxy_func_strdup(func, aggname);
+	agg->name = name ? plproxy_func_strdup(func, name) : NULL;
+	agg->position = position;
+	agg->attno = -1;
+}
+
+/* Take LIMIT from integer argument */
+bool
+plproxy_limit_set_arg(ProxyFunction *func, const char *ident)
+{
+	int			argindex;
+
+	if ((argindex = plproxy_get_parameter_index(func, ident)) < 0)
+		return false;
+
+	switch (func->arg_types[argindex]->type_oid)
+	{
+		case INT2OID:
+		case INT4OID:
+		case INT8OID:
+			break;
+		default:
+			plproxy_error(func, "LIMIT parameter is not an integer: %s", ident);
+	}
+
+	func->limit_arg = argindex;
+	return true;
+}
+
 /* Initialize PL/Proxy function cache */
 void
 plproxy_function_cache_init(void)
@@ -253,6 +334,7 @@ fn_new(HeapTuple proc_tuple)
 	f->ctx = f_ctx;
 	f->oid = XProcTupleGetOid(proc_tuple);
 	plproxy_set_stamp(&f->stamp, proc_tuple);
+	f->result_rev = ++result_rev_seq;
 
 	if (fn_returns_dynamic_record(proc_tuple))
 		f->dynamic_record = 1;
@@ -404,7 +486,6 @@ fn_get_return_type(ProxyFunction *func,
 	TupleDesc	ret_tup;
 	TypeFuncClass rtc;
 	MemoryContext old_ctx;
-	int			natts;
 
 
 	/*
@@ -421,12 +502,9 @@ fn_get_return_type(ProxyFunction *func,
 	{
 		case TYPEFUNC_COMPOSITE:
 			func->ret_composite = plproxy_composite_info(func, ret_tup);
-			natts = func->ret_composite->tupdesc->natts;
-			func->result_map = plproxy_func_alloc(func, natts * sizeof(int));
 			break;
 		case TYPEFUNC_SCALAR:
 			func->ret_scalar = plproxy_find_type_info(func, ret_oid, 0);
-			func->result_map = NULL;
 			break;
 		case TYPEFUNC_RECORD:
 		case TYPEFUNC_OTHER:
@@ -439,6 +517,313 @@ fn_get_return_type(ProxyFunction *func,
 	}
 }
 
+/*
+ * Validator has no call info, but ORDER BY and AGGREGATE can be
+ * checked against declared result type if it is not polymorphic.
+ * Returns false if result type is known only at call time.
+ */
+static bool
+fn_get_declared_return_type(ProxyFunction *func, HeapTuple proc_tuple)
+{
+	Form_pg_proc proc_struct = (Form_pg_proc) GETSTRUCT(proc_tuple);
+	Oid			ret_oid;
+	TupleDesc	ret_tup;
+	TypeFuncClass rtc;
+	MemoryContext old_ctx;
+
+	if (IsPolymorphicType(proc_struct->prorettype))
+		return false;
+
+	old_ctx = MemoryContextSwitchTo(func->ctx);
+	rtc = get_func_result_type(XProcTupleGetOid(proc_tuple), &ret_oid, &ret_tup);
+	MemoryContextSwitchTo(old_ctx);
+
+	switch (rtc)
+	{
+		case TYPEFUNC_COMPOSITE:
+			func->ret_composite = plproxy_composite_info(func, ret_tup);
+			return true;
+		case TYPEFUNC_SCALAR:
+			func->ret_scalar = plproxy_find_type_info(func, ret_oid, 0);
+			return true;
+		default:
+			return false;
+	}
+}
+
+/*
+ * Find result column by name or 1-based position.
+ *
+ * Scalar result has only column 1.  Returns -1 if not found.
+ */
+static int
+fn_find_column(ProxyFunction *func, const char *name, int position)
+{
+	TupleDesc	tupdesc;
+	Form_pg_attribute a;
+	char	   *dname = NULL;
+	int			xi,
+				pos;
+
+	if (!func->ret_composite)
+		return position == 1 ? 0 : -1;
+
+	tupdesc = func->ret_composite->tupdesc;
+	if (name)
+		dname = downcase_truncate_identifier(name, strlen(name), false);
+
+	for (xi = 0, pos = 0; xi < tupdesc->natts; xi++)
+	{
+		a = TupleDescAttr(tupdesc, xi);
+		if (a->attisdropped)
+			continue;
+		pos++;
+		if (dname ? strcmp(NameStr(a->attname), dname) == 0 : pos == position)
+			return xi;
+	}
+	return -1;
+}
+
+/* Type and collation of result column */
+static ProxyType *
+fn_column_type(ProxyFunction *func, int attno, Oid *collation)
+{
+	if (func->ret_composite)
+	{
+		*collation = TupleDescAttr(func->ret_composite->tupdesc, attno)->attcollation;
+		return func->ret_composite->type_list[attno];
+	}
+	*collation = get_typcollation(func->ret_scalar->type_oid);
+	return func->ret_scalar;
+}
+
+/*
+ * Find ORDER BY columns in result and prepare comparators.
+ *
+ * Partitions must sort with same rules: default btree
+ * ordering of the type, NULLS LAST for ASC, NULLS FIRST for DESC.
+ * Validator only checks columns and operators, comparators
+ * are prepared when sort_support is set.
+ */
+static void
+fn_resolve_order(ProxyFunction *func, bool sort_support)
+{
+	ProxyOrderKey *key;
+	Oid			collation,
+				lt_opr,
+				gt_opr;
+	int			k;
+
+	for (k = 0; k < func->order_count; k++)
+	{
+		key = &func->order_keys[k];
+		key->attno = fn_find_column(func, key->name, key->position);
+		if (key->attno < 0)
+		{
+			if (key->name)
+				plproxy_error(func, "ORDER BY column not in result: %s", key->name);
+			plproxy_error(func, "ORDER BY position not in result: %d", key->position);
+		}
+		key->type = fn_column_type(func, key->attno, &collation);
+
+		get_sort_group_operators(key->type->type_oid, true, false, false,
+								 &lt_opr, NULL, &gt_opr, NULL);
+		if (!sort_support)
+			continue;
+
+		memset(&key->ssup, 0, sizeof(key->ssup));
+		key->ssup.ssup_cxt = func->ctx;
+		key->ssup.ssup_collation = collation;
+		key->ssup.ssup_nulls_first = key->desc;
+		PrepareSortSupportFromOrderingOp(key->desc ? gt_opr : lt_opr, &key->ssup);
+	}
+}
+
+/*
+ * Find function that combines partial results of aggregate.
+ *
+ * Partial sums and counts are added up with "+" operator of
+ * column type.  Others use combine function of aggregate that
+ * has column type as argument and state and no final function,
+ * like min() and max().
+ */
+static Oid
+fn_combine_func(ProxyFunction *func, ProxyAggregate *agg)
+{
+	Oid			typid = agg->type->type_oid;
+	Oid			oprid,
+				aggoid,
+				combinefn = InvalidOid;
+	char	   *aggname;
+	HeapTuple	tup;
+	Form_pg_aggregate aggform;
+
+	aggname = downcase_truncate_identifier(agg->aggname, strlen(agg->aggname), false);
+
+	if (strcmp(aggname, "sum") == 0 || strcmp(aggname, "count") == 0)
+	{
+		oprid = OpernameGetOprid(list_make1(makeString("+")), typid, typid);
+		if (OidIsValid(oprid) && get_op_rettype(oprid) == typid)
+			return get_opcode(oprid);
+		return InvalidOid;
+	}
+
+	aggoid = LookupFuncName(list_make1(makeString(aggname)), 1, &typid, true);
+	if (!OidIsValid(aggoid))
+		return InvalidOid;
+
+	tup = SearchSysCache1(AGGFNOID, ObjectIdGetDatum(aggoid));
+	if (!HeapTupleIsValid(tup))
+		return InvalidOid;
+	aggform = (Form_pg_aggregate) GETSTRUCT(tup);
+	if (aggform->aggtranstype == typid && !OidIsValid(aggform->aggfinalfn))
+		combinefn = aggform->aggcombinefn;
+	ReleaseSysCache(tup);
+
+	return combinefn;
+}
+
+/*
+ * Find AGGREGATE columns in result and their combine functions.
+ *
+ * Function returns one row, so all columns must be aggregated.
+ */
+static void
+fn_resolve_aggregates(ProxyFunction *func)
+{
+	ProxyAggregate *agg;
+	TupleDesc	tupdesc = func->ret_composite ? func->ret_composite->tupdesc : NULL;
+	Oid			fnoid;
+	int			k,
+				j,
+				xi;
+
+	for (k = 0; k < func->agg_count; k++)
+	{
+		agg = &func->aggs[k];
+		agg->attno = fn_find_column(func, agg->name, agg->position);
+		if (agg->attno < 0)
+		{
+			if (agg->name)
+				plproxy_error(func, "AGGREGATE column not in result: %s", agg->name);
+			plproxy_error(func, "AGGREGATE position not in result: %d", agg->position);
+		}
+		for (j = 0; j < k; j++)
+		{
+			if (func->aggs[j].attno != agg->attno)
+				continue;
+			if (agg->name)
+				plproxy_error(func, "AGGREGATE column specified more than once: %s", agg->name);
+			plproxy_error(func, "AGGREGATE position specified more than once: %d", agg->position);
+		}
+		agg->type = fn_column_type(func, agg->attno, &agg->collation);
+
+		fnoid = fn_combine_func(func, agg);
+		if (!OidIsValid(fnoid))
+			plproxy_error(func, "cannot combine partial results of %s(%s)",
+						  agg->aggname, agg->type->name);
+		fmgr_info_cxt(fnoid, &agg->combine, func->ctx);
+		agg->is_count = pg_strcasecmp(agg->aggname, "count") == 0;
+	}
+
+	/* every column needs a value */
+	for (xi = 0; tupdesc && xi < tupdesc->natts; xi++)
+	{
+		if (TupleDescAttr(tupdesc, xi)->attisdropped)
+			continue;
+		for (k = 0; k < func->agg_count; k++)
+		{
+			if (func->aggs[k].attno == xi)
+				break;
+		}
+		if (k == func->agg_count)
+			plproxy_error(func, "AGGREGATE missing for column: %s",
+						  NameStr(TupleDescAttr(tupdesc, xi)->attname));
+	}
+}
+
+/*
+ * RUN ON func(arg, ...): if func is immutable internal or C function,
+ * call it directly instead of hash_sql via SPI.  Anything else,
+ * including functions that need argument casts, stays with SPI.
+ */
+static void
+fn_resolve_hash(ProxyFunction *func)
+{
+	Oid			types[FUNC_MAX_ARGS];
+	List	   *names = NIL;
+	HeapTuple	tup;
+	Form_pg_proc proc;
+	Oid			fnoid;
+	Oid			collation = InvalidOid;
+	char	   *name,
+			   *src,
+			   *dst,
+			   *dot;
+	bool		ok;
+	int			i,
+				idx;
+
+	func->hash_direct = false;
+	if (!func->hash_fn_name || func->hash_fn_nargs < 1 || func->hash_fn_nargs > 3)
+		return;
+
+	/* "schema . name" -> list of downcased parts */
+	name = pstrdup(func->hash_fn_name);
+	for (src = dst = name; *src; src++)
+	{
+		if (!isspace((unsigned char) *src))
+			*dst++ = *src;
+	}
+	*dst = 0;
+	for (src = name; src; src = dot)
+	{
+		dot = strchr(src, '.');
+		if (dot)
+			*dot++ = 0;
+		names = lappend(names, makeString(downcase_truncate_identifier(src, strlen(src), false)));
+	}
+
+	for (i = 0; i < func->hash_fn_nargs; i++)
+	{
+		idx = func->hash_fn_args[i];
+		if (IS_SPLIT_ARG(func, idx))
+			types[i] = func->arg_types[idx]->elem_type_oid;
+		else
+			types[i] = func->arg_types[idx]->type_oid;
+	}
+
+	fnoid = LookupFuncName(names, func->hash_fn_nargs, types, true);
+	if (!OidIsValid(fnoid))
+		return;
+
+	tup = SearchSysCache1(PROCOID, ObjectIdGetDatum(fnoid));
+	if (!HeapTupleIsValid(tup))
+		return;
+	proc = (Form_pg_proc) GETSTRUCT(tup);
+	ok = proc->provolatile == PROVOLATILE_IMMUTABLE && proc->proisstrict && !proc->proretset
+		&& (proc->prolang == INTERNALlanguageId || proc->prolang == ClanguageId)
+		&& (proc->prorettype == INT2OID || proc->prorettype == INT4OID
+			|| proc->prorettype == INT8OID)
+#if PG_VERSION_NUM >= 110000
+		&& proc->prokind == PROKIND_FUNCTION;
+#else
+		&& !proc->proisagg && !proc->proiswindow;
+#endif
+	func->hash_rettype = proc->prorettype;
+	ReleaseSysCache(tup);
+	if (!ok)
+		return;
+
+	/* plain parameters, so collation comes from their types */
+	for (i = 0; i < func->hash_fn_nargs && !OidIsValid(collation); i++)
+		collation = get_typcollation(types[i]);
+
+	fmgr_info_cxt(fnoid, &func->hash_finfo, func->ctx);
+	func->hash_collation = collation;
+	func->hash_direct = true;
+}
+
 /*
  * Check if cached ->ret_composite is valid, refresh if needed.
  */
@@ -451,7 +836,6 @@ fn_refresh_record(FunctionCallInfo fcinfo,
 	TupleDesc tuple_current, tuple_cached;
 	MemoryContext old_ctx;
 	Oid tuple_oid;
-	int natts;
 	TypeFuncClass rtc;
 
 	/*
@@ -470,16 +854,21 @@ fn_refresh_record(FunctionCallInfo fcinfo,
 	tuple_current = CreateTupleDescCopy(tuple_current);
 	MemoryContextSwitchTo(old_ctx);
 
+	/* result type changed, remote statements must be re-prepared */
+	func->result_rev = ++result_rev_seq;
+
 	/* release old data */
 	plproxy_free_composite(func->ret_composite);
-	pfree(func->result_map);
+	plproxy_forget_result_shapes(func);
 	pfree(func->remote_sql);
 
 	/* construct new data */
 	func->ret_composite = plproxy_composite_info(func, tuple_current);
-	natts = func->ret_composite->tupdesc->natts;
-	func->result_map = plproxy_func_alloc(func, natts * sizeof(int));
+	fn_resolve_order(func, true);
+	fn_resolve_aggregates(func);
 	func->remote_sql = plproxy_standard_query(func, true);
+	if (func->has_limit)
+		plproxy_query_add_limit(func, func->remote_sql);
 }
 
 /*
@@ -495,6 +884,7 @@ plproxy_compile(FunctionCallInfo fcinfo,
 {
 	ProxyFunction *f;
 	Form_pg_proc proc_struct;
+	bool		retset;
 
 	Assert(fcinfo || validate_only);
 
@@ -521,14 +911,32 @@ plproxy_compile(FunctionCallInfo fcinfo,
 	/* parse body */
 	fn_parse(f, proc_tuple);
 
+	/* validator can resolve only non-polymorphic result type */
+	if (f->order_count > 0 || f->agg_count > 0)
+	{
+		if (!validate_only)
+		{
+			fn_resolve_order(f, true);
+			fn_resolve_aggregates(f);
+		}
+		else if (fn_get_declared_return_type(f, proc_tuple))
+		{
+			fn_resolve_order(f, false);
+			fn_resolve_aggregates(f);
+		}
+	}
+
 	if (f->dynamic_record && f->remote_sql)
 		plproxy_error(f, "SELECT statement not allowed for dynamic RECORD functions");
 
 	/* sanity check */
-	if (f->run_type == R_ALL && (fcinfo
-								 ? !fcinfo->flinfo->fn_retset
-								 : !get_func_retset(XProcTupleGetOid(proc_tuple))))
-		plproxy_error(f, "RUN ON ALL requires set-returning function");
+	retset = fcinfo ? fcinfo->flinfo->fn_retset
+		: get_func_retset(XProcTupleGetOid(proc_tuple));
+	if (f->has_limit && !retset)
+		plproxy_error(f, "LIMIT requires set-returning function");
+	if ((f->run_type == R_ALL || f->partial) && f->agg_count == 0 && !retset)
+		plproxy_error(f, "%s requires set-returning function",
+					  f->run_type == R_ALL ? "RUN ON ALL" : "PARTIAL");
 
 	return f;
 }
@@ -576,11 +984,19 @@ plproxy_compile_and_cache(FunctionCallInfo fcinfo)
 		if (f->remote_sql == NULL)
 			f->remote_sql = plproxy_standard_query(f, true);
 
+		/* push LIMIT down to partitions */
+		if (f->has_limit)
+			plproxy_query_add_limit(f, f->remote_sql);
+
 		/* prepare local queries */
 		if (f->cluster_sql)
 			plproxy_query_prepare(f, fcinfo, f->cluster_sql, false);
 		if (f->hash_sql)
+		{
+			/* also direct calls need it, when caller lacks EXECUTE */
+			fn_resolve_hash(f);
 			plproxy_query_prepare(f, fcinfo, f->hash_sql, true);
+		}
 		if (f->connect_sql)
 			plproxy_query_prepare(f, fcinfo, f->connect_sql, false);
 
@@ -53,6 +53,7 @@ PG_MODULE_MAGIC;
 
 PG_FUNCTION_INFO_V1(plproxy_call_handler);
 PG_FUNCTION_INFO_V1(plproxy_validator);
+PG_FUNCTION_INFO_V1(plproxy_prewarm);
 
 /*
  * Centralised error reporting.
@@ -131,6 +132,7 @@ plproxy_startup_init(void)
 	plproxy_function_cache_init();
 	plproxy_cluster_cache_init();
 	plproxy_syscache_callback_init();
+	plproxy_exec_init();
 
 	initialized = true;
 }
@@ -197,35 +199,112 @@ compile_and_execute(FunctionCallInfo fcinfo)
 	return func;
 }
 
+/*
+ * Executor stopped reading rows before the end, stop remote queries.
+ */
+static void
+stream_shutdown(Datum arg)
+{
+	ProxyFunction *func = (ProxyFunction *) DatumGetPointer(arg);
+
+	plproxy_stream_cancel(func);
+}
+
+/*
+ * Return all rows at once in tuplestore.
+ */
+static Datum
+materialize_ret_set(ProxyFunction *func, FunctionCallInfo fcinfo)
+{
+	ReturnSetInfo *rsi = (ReturnSetInfo *) fcinfo->resultinfo;
+	ProxyCluster *cluster = func->cur_cluster;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext old_ctx;
+
+	if (cluster->spill_store)
+	{
+		/* result_memory_limit: rows were stored while receiving */
+		tupstore = cluster->spill_store;
+		tupdesc = cluster->spill_desc;
+		cluster->spill_store = NULL;
+		cluster->spill_desc = NULL;
+	}
+	else
+	{
+		/* executor frees setDesc, so give it a copy */
+		old_ctx = MemoryContextSwitchTo(rsi->econtext->ecxt_per_query_memory);
+		tupdesc = plproxy_result_desc(func);
+		tupstore = tuplestore_begin_heap(rsi->allowedModes & SFRM_Materialize_Random,
+										 false, work_mem);
+		MemoryContextSwitchTo(old_ctx);
+
+		plproxy_result_store(func, fcinfo, tupstore, tupdesc);
+	}
+	plproxy_clean_results(cluster);
+
+	rsi->returnMode = SFRM_Materialize;
+	rsi->setResult = tupstore;
+	rsi->setDesc = tupdesc;
+
+	return (Datum) 0;
+}
+
 /*
  * Logic for set-returning functions.
  *
- * Currently it uses the simplest, return
+ * If executor allows, whole result is returned at once
+ * in tuplestore.  Otherwise, it uses the simplest, return
  * one value/tuple per call mechanism.
+ *
+ * In streaming mode the rows are fetched from
+ * partitions between calls.
  */
 static Datum
 handle_ret_set(FunctionCallInfo fcinfo)
 {
 	ProxyFunction *func;
 	FuncCallContext *ret_ctx;
+	ReturnSetInfo *rsi = (ReturnSetInfo *) fcinfo->resultinfo;
+	ProxyCluster *cluster;
+	bool		more;
 
 	if (SRF_IS_FIRSTCALL())
 	{
 		func = compile_and_execute(fcinfo);
+
+		/* streaming keeps memory bounded by itself */
+		if (!func->cur_cluster->stream && rsi && IsA(rsi, ReturnSetInfo)
+			&& (rsi->allowedModes & SFRM_Materialize))
+			return materialize_ret_set(func, fcinfo);
+
 		ret_ctx = SRF_FIRSTCALL_INIT();
 		ret_ctx->user_fctx = func;
+
+		if (func->cur_cluster->stream && rsi && IsA(rsi, ReturnSetInfo))
+			RegisterExprContextCallback(rsi->econtext, stream_shutdown,
+										PointerGetDatum(func));
 	}
 
 	ret_ctx = SRF_PERCALL_SETUP();
 	func = ret_ctx->user_fctx;
+	cluster = func->cur_cluster;
 
-	if (func->cur_cluster->ret_total > 0)
+	if (cluster->stream)
+		more = plproxy_stream_fetch(func);
+	else
+		more = cluster->ret_total > 0;
+
+	if (more)
 	{
 		SRF_RETURN_NEXT(ret_ctx, plproxy_result(func, fcinfo));
 	}
 	else
 	{
-		plproxy_clean_results(func->cur_cluster);
+		if (cluster->stream && rsi && IsA(rsi, ReturnSetInfo))
+			UnregisterExprContextCallback(rsi->econtext, stream_shutdown,
+										  PointerGetDatum(func));
+		plproxy_clean_results(cluster);
 		SRF_RETURN_DONE(ret_ctx);
 	}
 }
@@ -290,3 +369,88 @@ plproxy_validator(PG_FUNCTION_ARGS)
 
 	PG_RETURN_VOID();
 }
+
+/*
+ * Open connections to all partitions of a cluster
+ * ahead of actual traffic.
+ *
+ * Returns one row per partition: (part_nr, reused, connect_ms).
+ */
+Datum
+plproxy_prewarm(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo *rsi = (ReturnSetInfo *) fcinfo->resultinfo;
+	ProxyFunction *func;
+	ProxyCluster *cluster;
+	ProxyConnection *conn;
+	TupleDesc	tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext old_ctx;
+	Datum		values[3];
+	bool		nulls[3];
+	int			err;
+	int			i;
+
+	if (!rsi || !IsA(rsi, ReturnSetInfo) || !(rsi->allowedModes & SFRM_Materialize))
+		elog(ERROR, "plproxy_prewarm: materialize mode required");
+	if (PG_ARGISNULL(0))
+		elog(ERROR, "plproxy_prewarm: cluster name must not be NULL");
+
+	run_maint();
+
+	/* result must survive SPI_finish() */
+	old_ctx = MemoryContextSwitchTo(rsi->econtext->ecxt_per_query_memory);
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "plproxy_prewarm: return type must be a row type");
+	tupdesc = CreateTupleDescCopy(tupdesc);
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+
+	/* fake function for cluster lookup and error messages */
+	func = palloc0(sizeof(*func));
+	func->name = "plproxy_prewarm";
+	func->arg_count = 1;
+	func->cluster_name = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	MemoryContextSwitchTo(old_ctx);
+
+	/* prepare SPI */
+	err = SPI_connect();
+	if (err != SPI_OK_CONNECT)
+		elog(ERROR, "SPI_connect: %s", SPI_result_code_string(err));
+
+	plproxy_startup_init();
+
+	cluster = plproxy_find_cluster(func, fcinfo);
+	if (cluster->busy)
+		plproxy_error(func, "Nested PL/Proxy calls to the same cluster are not supported.");
+
+	func->cur_cluster = cluster;
+	plproxy_prewarm_cluster(func);
+
+	err = SPI_finish();
+	if (err != SPI_OK_FINISH)
+		elog(ERROR, "SPI_finish: %s", SPI_result_code_string(err));
+
+	old_ctx = MemoryContextSwitchTo(rsi->econtext->ecxt_per_query_memory);
+	for (i = 0; i < cluster->part_count; i++)
+	{
+		conn = cluster->part_map[i];
+
+		values[0] = Int32GetDatum(i);
+		nulls[0] = false;
+		values[1] = BoolGetDatum(conn->connect_ms < 0);
+		nulls[1] = false;
+		values[2] = Int64GetDatum(conn->connect_ms);
+		nulls[2] = conn->connect_ms < 0;
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	}
+	MemoryContextSwitchTo(old_ctx);
+
+	plproxy_clean_results(cluster);
+
+	rsi->returnMode = SFRM_Materialize;
+	rsi->setResult = tupstore;
+	rsi->setDesc = tupdesc;
+
+	return (Datum) 0;
+}
@@ -42,7 +42,8 @@ extern int plproxy_yynerrs;
 static ProxyFunction *xfunc;
 
 /* remember what happened */
-static int got_run, got_cluster, got_connect, got_split, got_target;
+static int got_run, got_cluster, got_connect, got_split, got_target, got_readonly;
+static int got_partial, got_order, got_limit, got_aggregate;
 
 static QueryBuffer *cluster_sql;
 static QueryBuffer *select_sql;
@@ -52,14 +53,69 @@ static QueryBuffer *connect_sql;
 /* points to one of the above ones */
 static QueryBuffer *cur_sql;
 
+/* RUN ON func(arg, ...): function name and arguments, NULL if not such form */
+static char *hash_fn;
+static int hash_fn_nargs;
+static int hash_fn_args[FUNC_MAX_ARGS];
+static enum { HFN_ARG, HFN_SEP, HFN_END } hash_fn_state;
+
 /* keep the resetting code together with variables */
 static void reset_parser_vars(void)
 {
-	got_run = got_cluster = got_connect = got_split = got_target = 0;
+	got_run = got_cluster = got_connect = got_split = got_target = got_readonly = 0;
+	got_partial = got_order = got_limit = got_aggregate = 0;
 	cur_sql = select_sql = cluster_sql = hash_sql = connect_sql = NULL;
+	hash_fn = NULL;
+	hash_fn_nargs = 0;
 	xfunc = NULL;
 }
 
+/* track whether hash function arguments are plain argument references */
+static void hash_fn_token(const char *tok, bool ident)
+{
+	int idx;
+
+	if (!hash_fn || (!ident && strcmp(tok, " ") == 0))
+		return;
+
+	if (ident && hash_fn_state == HFN_ARG)
+	{
+		idx = plproxy_get_parameter_index(xfunc, tok);
+		if (idx >= 0 && hash_fn_nargs < FUNC_MAX_ARGS)
+		{
+			hash_fn_args[hash_fn_nargs++] = idx;
+			hash_fn_state = HFN_SEP;
+			return;
+		}
+	}
+	else if (!ident && hash_fn_state == HFN_SEP && strcmp(tok, ",") == 0)
+	{
+		hash_fn_state = HFN_ARG;
+		return;
+	}
+	else if (!ident && strcmp(tok, ")") == 0
+			 && (hash_fn_state == HFN_SEP || (hash_fn_state == HFN_ARG && hash_fn_nargs == 0)))
+	{
+		hash_fn_state = HFN_END;
+		return;
+	}
+	hash_fn = NULL;
+}
+
+/* remember function name from FNCALL token */
+static void hash_fn_start(const char *fncall)
+{
+	char *p;
+
+	hash_fn = pstrdup(fncall);
+	p = strchr(hash_fn, '(');
+	*p = 0;
+	while (p > hash_fn && isspace((unsigned char) p[-1]))
+		*--p = 0;
+	hash_fn_nargs = 0;
+	hash_fn_state = HFN_ARG;
+}
+
 %}
 
 /*
@@ -72,7 +128,8 @@ static void reset_parser_vars(void)
 
 %token <str> CONNECT CLUSTER RUN ON ALL ANY SELECT
 %token <str> IDENT NUMBER FNCALL SPLIT STRING
-%token <str> SQLIDENT SQLPART TARGET
+%token <str> SQLIDENT SQLPART TARGET READONLY PARTIAL ORDERBY LIMIT
+%token <str> AGGREGATE RANGE
 
 %union
 {
@@ -83,7 +140,9 @@ static void reset_parser_vars(void)
 
 body: | body stmt ;
 
-stmt: cluster_stmt | split_stmt | run_stmt | select_stmt | connect_stmt | target_stmt;
+stmt: cluster_stmt | split_stmt | run_stmt | select_stmt | connect_stmt | target_stmt
+	| readonly_stmt | partial_stmt | order_stmt | limit_stmt
+	| aggregate_stmt;
 
 connect_stmt: CONNECT connect_spec ';'	{
 					if (got_connect)
@@ -139,6 +198,77 @@ target_stmt: TARGET target_name ';' {
 target_name: IDENT { xfunc->target_name = plproxy_func_strdup(xfunc, $1); }
 		   ;
 
+readonly_stmt: READONLY ';' {
+							if (got_readonly)
+								yyerror("Only one READONLY statement allowed");
+							xfunc->read_only = true;
+							got_readonly = 1; }
+			 ;
+
+partial_stmt: PARTIAL partial_spec ';' {
+							if (got_partial)
+								yyerror("Only one PARTIAL statement allowed");
+							xfunc->partial = true;
+							got_partial = 1; }
+			;
+
+partial_spec: | partial_timeout
+			;
+
+order_stmt: ORDERBY order_list ';' {
+							if (got_order)
+								yyerror("Only one ORDER BY statement allowed");
+							got_order = 1; }
+		  ;
+
+order_list: order_item
+		  | order_list ',' order_item
+		  ;
+
+order_item: order_col
+		  | order_col IDENT { if (!plproxy_order_set_dir(xfunc, $2))
+								yyerror("invalid ORDER BY direction: %s", $2); }
+		  ;
+
+order_col: IDENT	{ plproxy_order_add(xfunc, $1, 0); }
+		 | NUMBER	{ if (atoi($1) < 1)
+						yyerror("invalid ORDER BY position: %s", $1);
+					  plproxy_order_add(xfunc, NULL, atoi($1)); }
+		 ;
+
+limit_stmt: LIMIT limit_spec ';' {
+							if (got_limit)
+								yyerror("Only one LIMIT statement allowed");
+							xfunc->has_limit = true;
+							got_limit = 1; }
+		  ;
+
+limit_spec: NUMBER	{ xfunc->limit_arg = -1;
+					  xfunc->limit_value = strtoll($1, NULL, 10); }
+		  | IDENT	{ if (!plproxy_limit_set_arg(xfunc, $1))
+						yyerror("invalid argument reference: %s", $1); }
+		  ;
+
+aggregate_stmt: AGGREGATE aggregate_list ';' {
+							if (got_aggregate)
+								yyerror("Only one AGGREGATE statement allowed");
+							got_aggregate = 1; }
+			  ;
+
+aggregate_list: aggregate_item
+			  | aggregate_list ',' aggregate_item
+			  ;
+
+aggregate_item: IDENT '(' IDENT ')'		{ plproxy_aggregate_add(xfunc, $1, $3, 0); }
+			  | IDENT '(' NUMBER ')'	{ if (atoi($3) < 1)
+											yyerror("invalid AGGREGATE position: %s", $3);
+										  plproxy_aggregate_add(xfunc, $1, NULL, atoi($3)); }
+			  ;
+
+partial_timeout: STRING	{ if (!plproxy_parse_timeout($1, &xfunc->partial_timeout))
+							yyerror("invalid PARTIAL timeout: %s", $1); }
+			;
+
 split_stmt: SPLIT split_spec ';' {
 							if (got_split)
 								yyerror("Only one SPLIT statement allowed");
@@ -169,6 +299,10 @@ run_spec: hash_func sql_token_list	{ xfunc->run_type = R_HASH; }
 		| ANY						{ xfunc->run_type = R_ANY; }
 		| ALL						{ xfunc->run_type = R_ALL; }
 		| hash_direct				{ xfunc->run_type = R_HASH; }
+		| RANGE IDENT				{ xfunc->run_type = R_RANGE;
+									  xfunc->range_arg = plproxy_get_parameter_index(xfunc, $2);
+									  if (xfunc->range_arg < 0)
+										  yyerror("invalid argument reference: %s", $2); }
 		;
 
 hash_direct: IDENT	{	hash_sql = plproxy_query_start(xfunc, false);
@@ -181,6 +315,7 @@ hash_direct: IDENT	{	hash_sql = plproxy_query_start(xfunc, false);
 
 hash_func: FNCALL	{ hash_sql = plproxy_query_start(xfunc, false);
 	 				  cur_sql = hash_sql;
+	 				  hash_fn_start($1);
 	 				  plproxy_query_add_const(cur_sql, "select * from ");
 	 				  plproxy_query_add_const(cur_sql, $1); }
 		 ;
@@ -196,8 +331,12 @@ sql_start: SELECT		{ if (select_sql)
 sql_token_list: sql_token
 			  | sql_token_list sql_token
 		      ;
-sql_token: SQLPART		{ plproxy_query_add_const(cur_sql, $1); }
-		 | SQLIDENT		{ if (!plproxy_query_add_ident(cur_sql, $1))
+sql_token: SQLPART		{ if (cur_sql == hash_sql)
+							hash_fn_token($1, false);
+						  plproxy_query_add_const(cur_sql, $1); }
+		 | SQLIDENT		{ if (cur_sql == hash_sql)
+							hash_fn_token($1, true);
+						  if (!plproxy_query_add_ident(cur_sql, $1))
 							yyerror("invalid argument reference: %s", $1); }
 		 ;
 
@@ -262,13 +401,27 @@ void plproxy_run_parser(ProxyFunction *func, const char *body, int len)
 	if (select_sql && got_target)
 		yyerror("TARGET cannot be used with SELECT");
 
+	if (got_aggregate && (got_order || got_limit))
+		yyerror("AGGREGATE cannot be used with ORDER BY/LIMIT");
+
 	/* release scanner resources */
 	plproxy_yylex_destroy();
 
 	/* copy hash data if needed */
 	if (xfunc->run_type == R_HASH)
+	{
 		xfunc->hash_sql = plproxy_query_finish(hash_sql);
 
+		/* candidate for direct call, resolved later */
+		if (hash_fn && hash_fn_state == HFN_END)
+		{
+			xfunc->hash_fn_name = plproxy_func_strdup(xfunc, hash_fn);
+			xfunc->hash_fn_nargs = hash_fn_nargs;
+			xfunc->hash_fn_args = MemoryContextAlloc(xfunc->ctx, Max(hash_fn_nargs, 1) * sizeof(int));
+			memcpy(xfunc->hash_fn_args, hash_fn_args, hash_fn_nargs * sizeof(int));
+		}
+	}
+
 	/* store sql */
 	if (select_sql)
 		xfunc->remote_sql = plproxy_query_finish(select_sql);
@@ -39,6 +39,10 @@
 #include <access/htup_details.h>
 #include <access/reloptions.h>
 #include <access/tupdesc.h>
+#include <access/xact.h>
+#include <catalog/namespace.h>
+#include <catalog/pg_aggregate.h>
+#include <catalog/pg_language.h>
 #include <catalog/pg_namespace.h>
 #include <catalog/pg_proc.h>
 #include <catalog/pg_type.h>
@@ -47,14 +51,22 @@
 #include <mb/pg_wchar.h>
 #include <miscadmin.h>
 #include <nodes/value.h>
+#include <parser/parse_func.h>
+#include <parser/parse_oper.h>
+#include <parser/scansup.h>
 #include <utils/acl.h>
 #include <utils/array.h>
 #include <utils/builtins.h>
+#include <utils/datum.h>
 #include <utils/hsearch.h>
 #include <utils/inval.h>
 #include <utils/lsyscache.h>
 #include <utils/memutils.h>
+#include <utils/sortsupport.h>
 #include <utils/syscache.h>
+#include <utils/tuplestore.h>
+#include <utils/typcache.h>
+#include <utils/uuid.h>
 
 #include "aatree.h"
 #include "rowstamp.h"
@@ -85,6 +97,10 @@
 #define ACL_KIND_FOREIGN_SERVER OBJECT_FOREIGN_SERVER
 #endif
 
+#if PG_VERSION_NUM < 120000
+#define CreateTemplateTupleDesc(natts) CreateTemplateTupleDesc(natts, false)
+#endif
+
 /*
  * Determine if this argument is to SPLIT
  */
@@ -102,15 +118,50 @@
  */
 #define PLPROXY_IDLE_CONN_CHECK		2
 
+/*
+ * Max number of remote prepared statements kept per connection.
+ * Queries over the limit are sent unprepared.
+ */
+#define PLPROXY_MAX_PREPARED		100
+
+/*
+ * Max number of different result shapes whose column mapping
+ * is remembered per function with custom SELECT.
+ */
+#define PLPROXY_MAX_RESULT_SHAPES	4
+
+/*
+ * Number of recent RUN ON ANY latencies kept per cluster
+ * for hedge_percentile.
+ */
+#define PLPROXY_HEDGE_SAMPLES		64
+
+/*
+ * Rows per chunk when results are stored while receiving
+ * them because of result_memory_limit.
+ */
+#define PLPROXY_SPILL_CHUNK_ROWS	1000
+
+/* Max number of buckets in cluster bucket map */
+#define PLPROXY_MAX_BUCKETS			65536
+
 /* Flag indicating where function should be executed */
 typedef enum RunOnType
 {
 	R_HASH = 1,				/* partition(s) returned by hash function */
 	R_ALL = 2,				/* on all partitions */
 	R_ANY = 3,				/* decide randomly during runtime */
-	R_EXACT = 4				/* exact part number */
+	R_EXACT = 4,			/* exact part number */
+	R_RANGE = 5				/* partition whose key range holds the argument */
 } RunOnType;
 
+/* How READONLY functions pick partition replica */
+typedef enum ReplicaSelection
+{
+	REPLICA_ROUND_ROBIN = 0,	/* take replicas in turn */
+	REPLICA_LEAST_LATENCY = 1	/* replica with fastest recent queries */
+} ReplicaSelection;
+
 /* Connection states for async handler */
 typedef enum ConnState
 {
@@ -126,11 +177,19 @@ typedef enum ConnState
 /* Stores result from plproxy.get_cluster_config() */
 typedef struct ProxyConfig
 {
-	int			connect_timeout;		/* How long connect may take (secs) */
-	int			query_timeout;			/* How long query may take (secs) */
+	int			connect_timeout;		/* How long connect may take (msecs) */
+	int			query_timeout;			/* How long query may take (msecs) */
 	int			connection_lifetime;	/* How long the connection may live (secs) */
 	int			disable_binary;			/* Avoid binary I/O */
 	int			modular_mapping;		/* Use modulus (%) instead masking (&) */
+	int			prepared_statements;	/* Cache remote prepared statements */
+	int			stream_chunk_size;		/* Rows per fetch when streaming, 0 - disabled */
+	int			hedge_delay;			/* RUN ON ANY: query second partition after (msecs) */
+	int			hedge_percentile;		/* Take hedge delay from observed latencies */
+	int			replica_selection;		/* ReplicaSelection for READONLY functions */
+	int			result_memory_limit;	/* Rows over this many kB go to disk, 0 - disabled */
+	char	   *buckets;				/* Bucket map as given, NULL - not used */
+	char	   *range_bounds;			/* RUN ON RANGE lower bounds as given, NULL - not set */
 	char		default_user[NAMEDATALEN];
 } ProxyConfig;
 
@@ -145,6 +204,17 @@ typedef struct ConnUserInfo {
 	bool needs_reload;
 } ConnUserInfo;
 
+/* Remote prepared statement */
+typedef struct ProxyPreparedStmt {
+	struct AANode node;			/* node head in state->stmt_tree */
+
+	Oid			fn_oid;			/* Function, lookup key */
+	const char *sql;			/* Query text */
+	TransactionId fn_xmin;		/* Function definition it was prepared for */
+	int			fn_rev;			/* ProxyFunction->result_rev when prepared */
+	char		name[32];		/* Statement name on remote side */
+} ProxyPreparedStmt;
+
 typedef struct ProxyConnectionState {
 	struct AANode node;			/* node head in user->state tree */
 
@@ -155,10 +225,23 @@ typedef struct ProxyConnectionState {
 	time_t		connect_time;	/* When connection was started */
 	time_t		query_time;		/* When last query was sent */
 	bool		same_ver;		/* True if dest backend has same X.Y ver */
-	bool		tuning;			/* True if tuning query is running on conn */
+	bool		tuning;			/* True if tuning or prepare query is running on conn */
 	bool		waitCancel;		/* True if waiting for answer from cancel */
+	int			tuning_results;	/* Tuning results before prepare in pipeline */
+	int			pipeline_skip;	/* Queries in pipeline before main query */
+
+	struct AATree stmt_tree;	/* fn_oid->ProxyPreparedStmt tree */
+	ProxyPreparedStmt *stmt_pending;	/* Statement being prepared */
+	int			stmt_seq;		/* Counter for statement names */
 } ProxyConnectionState;
 
+/* Where output attribute comes from in current PGresult */
+typedef struct ProxyResultCol
+{
+	int			col;			/* Result column, -1 if none */
+	int			fmt;			/* Its format, 0=text, 1=binary */
+} ProxyResultCol;
+
 /* Single database connection */
 typedef struct ProxyConnection
 {
@@ -182,16 +265,68 @@ typedef struct ProxyConnection
 
 	/*
 	 * Per-connection parameters. These are a assigned just before the 
-	 * remote call is made.
+	 * remote call is made, in text or binary depending on connection.
 	 */
 
 	Datum			   *split_params;					/* Split array parameters */
-	ArrayBuildState	  **bstate;							/* Temporary build state */
+	int					split_pos;						/* SPLIT: position in active_list */
 	const char		   *param_values[FUNC_MAX_ARGS];	/* Parameter values */
 	int					param_lengths[FUNC_MAX_ARGS];	/* Parameter lengths (binary io) */
 	int					param_formats[FUNC_MAX_ARGS];	/* Parameter formats (binary io) */
+
+	int64		deadline;		/* Connect or query deadline (msecs), 0 if none */
+
+	/* registration in cluster->wait_set */
+	int			wait_pos;		/* Position in set, -1 if not registered */
+	int			wait_fd;		/* Registered socket */
+	uint32		wait_events;	/* Registered events, 0 if parked */
+	bool		wait_dirty;		/* In cluster->wait_dirty list */
+
+	int64		connect_ms;		/* Prewarm: connect time (msecs), -1 if reused */
+
+	int64		query_start;	/* When current query was sent (usecs) */
+	int64		latency;		/* Decaying average of query time (usecs) */
+
+	bool		skipped;		/* PARTIAL, LIMIT: left out of results */
+	uint64		res_seq;		/* Streaming: arrival order of res */
+
+	/* Where output attributes are in res, filled for each query */
+	ProxyResultCol *result_map;
+	int			result_map_len;	/* Allocated entries */
+	int			result_map_rev;	/* Generated query: result_rev it was built for, 0 if none */
+	int			result_map_fmt;	/* Generated query: result format it was built for */
+	bool		result_mapped;	/* Filled for current query */
 } ProxyConnection;
 
+/* Connections that serve one partition, for READONLY functions */
+typedef struct ProxyReplicaSet
+{
+	int			count;			/* Number of connections, primary included */
+	int			next;			/* Round-robin position */
+	ProxyConnection **conns;	/* conns[0] is primary */
+} ProxyReplicaSet;
+
+/*
+ * Query parameter of current call.  Encoded when first
+ * connection needs it, text and binary form separately.
+ */
+typedef struct ProxyParam
+{
+	Datum		value;
+	bool		isnull;
+	bool		split;			/* Value is in ProxyConnection->split_params */
+	const char *data[2];		/* Encoded value by requested format, NULL if not done */
+	int			length[2];
+	int			format[2];		/* Actual format, type may not have binary output */
+} ProxyParam;
+
+/* Entry in deadline heap */
+typedef struct ProxyDeadline
+{
+	int64		time;			/* Deadline (msecs) */
+	ProxyConnection *conn;
+} ProxyDeadline;
+
 /* Info about one cluster */
 typedef struct ProxyCluster
 {
@@ -204,6 +339,17 @@ typedef struct ProxyCluster
 	int			part_count;		/* Number of partitions - power of 2 */
 	int			part_mask;		/* Mask to use to get part number from hash */
 	ProxyConnection **part_map; /* Pointers to ProxyConnections */
+	int		   *bucket_map;		/* Partition for each bucket, NULL if hash maps to partition */
+	int			bucket_count;	/* Number of buckets - power of 2 */
+	int			bucket_mask;	/* Mask to use to get bucket from hash */
+	Oid			range_type;		/* Type range_values are decoded for, InvalidOid - none */
+	Datum	   *range_values;	/* Lower bounds of partitions 1..N-1, ascending */
+	int			range_count;	/* Number of range_values - part_count - 1 */
+	FmgrInfo   *range_cmp;		/* Btree comparison function of range_type */
+	Oid			range_collation;
+	MemoryContext range_ctx;	/* Decoded range_values live here */
+	ProxyReplicaSet *replica_map;	/* Per-partition replicas, NULL if none */
+	int			replica_count;	/* Total number of replica connstrs */
 
 	int active_count;			/* number of active connections */
 	ProxyConnection **active_list; /* active ProxyConnection in current query */
@@ -223,6 +369,62 @@ typedef struct ProxyCluster
 	bool		sqlmed_cluster;	/* True if the cluster is defined using SQL/MED */
 	bool		needs_reload;	/* True if the cluster partition list should be reloaded */
 	bool		busy;			/* True if the cluster is already involved in execution */
+	bool		stream;			/* True if rows are fetched while returning them */
+
+	/* streaming: subtransaction that started the stream and list of streaming clusters */
+	SubTransactionId stream_subxact;
+	struct ProxyCluster *stream_next;
+
+	/* sockets of current execution, NULL if not used */
+	struct WaitEventSet *wait_set;
+	bool		wait_rebuild;	/* True if wait_set must be created again */
+	int			wait_size;		/* Events wait_set has room for */
+	int			wait_count;		/* Events registered in wait_set */
+
+	/* connections whose registration in wait_set may be outdated */
+	struct ProxyConnection **wait_dirty;
+	int			wait_dirty_count;
+	int			wait_dirty_alloc;
+
+	/* min-heap of connection deadlines in current execution */
+	ProxyDeadline *deadlines;
+	int			deadline_count;
+	int			deadline_alloc;
+
+	/* RUN ON ANY: time to send query to second partition, 0 if none */
+	int64		hedge_time;
+
+	/* PARTIAL: time to give up on unfinished partitions, 0 if none */
+	int64		partial_time;
+
+	/* LIMIT: rows that can still be returned, -1 if no limit */
+	int64		ret_limit;
+
+	/* streaming: counter for ProxyConnection->res_seq */
+	uint64		res_counter;
+
+	/* query parameters of current call, remote_sql->arg_count entries */
+	ProxyParam *params;
+
+	/* result_memory_limit: rows are stored while receiving */
+	bool		spill;
+	Tuplestorestate *spill_store;
+	TupleDesc	spill_desc;
+	MemoryContext spill_ctx;	/* Decoding garbage of one row */
+
+	/* ring buffer of recent RUN ON ANY latencies (msecs) */
+	int			hedge_samples[PLPROXY_HEDGE_SAMPLES];
+	int			hedge_nsamples;
+	int			hedge_pos;
+
+	/* ORDER BY: min-heap of active_list positions, by current row keys */
+	int		   *merge_heap;
+	int			merge_count;
+	bool		merge_init;		/* True if heap is built */
+	Datum	   *merge_values;	/* Current row keys, order_count per active conn */
+	bool	   *merge_nulls;
+	int			merge_alloc;	/* Allocated entries in arrays above */
+	MemoryContext merge_ctx;	/* Decoded key values */
 
 	/*
 	 * SQL/MED clusters: TIDs of the foreign server and user mapping catalog tuples.
@@ -257,6 +459,16 @@ typedef struct ProxyType
 	struct ProxyType *elem_type_t;	/* Elem type info, filled lazily */
 	short		length;			/* Type length */
 
+	/*
+	 * Decoders and encoders for common types that work without
+	 * fmgr, NULL if none.  Decoders return false on unusual
+	 * input, then the I/O function is used.
+	 */
+	bool		(*fast_recv_text) (const char *val, int len, Datum *res);
+	bool		(*fast_recv_bin) (const char *val, int len, Datum *res);
+	char	   *(*fast_send_text) (Datum val);
+	char	   *(*fast_send_bin) (Datum val, int *len);
+
 	/* I/O functions */
 	union
 	{
@@ -288,8 +500,54 @@ typedef struct ProxyComposite
 	bool		use_binary;		/* True if all columns support binary recv */
 	bool		alterable;		/* if it's real table that can change */
 	RowStamp	stamp;
+
+	/* per-row decode scratch, natts entries each */
+	char	  **values;			/* Column values from PGresult */
+	int		   *lengths;		/* Value lengths */
+	int		   *fmts;			/* Value formats */
+	Datum	   *dvalues;		/* Decoded values */
+	bool	   *nulls;			/* NULL flags */
 } ProxyComposite;
 
+/* Remembered column mapping for one kind of PGresult */
+typedef struct ProxyResultShape
+{
+	struct ProxyResultShape *next;
+	int			nfields;		/* Number of result columns */
+	Oid		   *types;			/* Column types */
+	int		   *fmts;			/* Column formats */
+	char	  **names;			/* Column names */
+	ProxyResultCol *map;		/* Mapping for it, natts entries */
+} ProxyResultShape;
+
+/* ORDER BY column */
+typedef struct ProxyOrderKey
+{
+	const char *name;			/* Column name, NULL if given by position */
+	int			position;		/* 1-based column position, 0 if by name */
+	bool		desc;			/* Descending order */
+
+	/* resolved against result type */
+	int			attno;			/* Output attribute index */
+	ProxyType  *type;			/* Column type */
+	SortSupportData ssup;		/* Comparator */
+} ProxyOrderKey;
+
+/* AGGREGATE column */
+typedef struct ProxyAggregate
+{
+	const char *aggname;		/* Aggregate function name */
+	const char *name;			/* Column name, NULL if given by position */
+	int			position;		/* 1-based column position, 0 if by name */
+
+	/* resolved against result type */
+	int			attno;			/* Output attribute index */
+	ProxyType  *type;			/* Column type */
+	Oid			collation;		/* Column collation */
+	FmgrInfo	combine;		/* Combines two partial results */
+	bool		is_count;		/* count() gives 0 when there are no rows */
+} ProxyAggregate;
+
 /* Temp structure for query parsing */
 typedef struct QueryBuffer QueryBuffer;
 
@@ -303,6 +561,7 @@ typedef struct ProxyQuery
 	int			arg_count;		/* Argument count for ->sql */
 	int		   *arg_lookup;		/* Maps local references to function args */
 	void	   *plan;			/* Optional prepared plan for local queries */
+	bool		typed_result;	/* Result columns are cast to local types */
 } ProxyQuery;
 
 /*
@@ -328,6 +587,7 @@ typedef struct ProxyFunction
 	MemoryContext ctx;			/* Where runtime allocations should happen */
 
 	RowStamp	stamp;			/* for pg_proc cache validation */
+	int			result_rev;		/* Result type revision, unique across functions */
 
 	ProxyType **arg_types;		/* Info about arguments */
 	char	  **arg_names;		/* Argument names, may contain NULLs */
@@ -348,10 +608,28 @@ typedef struct ProxyFunction
 
 	RunOnType	run_type;		/* Run type */
 	ProxyQuery *hash_sql;		/* Hash execution for R_HASH */
+	const char *hash_fn_name;	/* R_HASH: function called with plain arguments, or NULL */
+	int			hash_fn_nargs;
+	int		   *hash_fn_args;	/* Function argument index for each hash argument */
+	bool		hash_direct;	/* hash_finfo is called instead of hash_sql */
+	FmgrInfo	hash_finfo;
+	Oid			hash_collation;
+	Oid			hash_rettype;
 	int			exact_nr;		/* Hash value for R_EXACT */
+	int			range_arg;		/* Argument index of routing key for R_RANGE */
 	const char *connect_str;	/* libpq string for CONNECT function */
 	ProxyQuery *connect_sql;	/* Optional query for CONNECT function */
 	const char *target_name;	/* Optional target function name */
+	bool		read_only;		/* READONLY: may run on partition replica */
+	bool		partial;		/* PARTIAL: skip failed partitions */
+	int			partial_timeout;	/* PARTIAL: deadline (msecs), 0 if none */
+	ProxyOrderKey *order_keys;	/* ORDER BY: partitions return rows sorted */
+	int			order_count;	/* Number of ORDER BY columns */
+	bool		has_limit;		/* LIMIT: max number of rows to return */
+	int64		limit_value;	/* LIMIT constant */
+	int			limit_arg;		/* LIMIT from argument, -1 if constant */
+	ProxyAggregate *aggs;		/* AGGREGATE: partial results are combined */
+	int			agg_count;		/* Number of AGGREGATE columns */
 
 	/*
 	 * calculated data
@@ -369,16 +647,15 @@ typedef struct ProxyFunction
 	 */
 	ProxyCluster *cur_cluster;
 
-	/*
-	 * Maps result field num to libpq column num.
-	 * It is filled for each result.  NULL when scalar result.
-	 */
-	int		   *result_map;
+	/* Result mappings already calculated, most recent first */
+	ProxyResultShape *result_shapes;
+	int			result_shape_count;
 } ProxyFunction;
 
 /* main.c */
 Datum		plproxy_call_handler(PG_FUNCTION_ARGS);
 Datum		plproxy_validator(PG_FUNCTION_ARGS);
+Datum		plproxy_prewarm(PG_FUNCTION_ARGS);
 void		plproxy_error_with_state(ProxyFunction *func, int sqlstate, const char *fmt, ...)
 	__attribute__((format(PG_PRINTF_ATTRIBUTE, 3, 4)));
 void		plproxy_remote_error(ProxyFunction *func, ProxyConnection *conn, const PGresult *res, bool iserr);
@@ -391,11 +668,20 @@ char	   *plproxy_func_strdup(ProxyFunction *func, const char *s);
 int			plproxy_get_parameter_index(ProxyFunction *func, const char *ident);
 bool		plproxy_split_add_ident(ProxyFunction *func, const char *ident);
 void		plproxy_split_all_arrays(ProxyFunction *func);
+void		plproxy_order_add(ProxyFunction *func, const char *name, int position);
+bool		plproxy_order_set_dir(ProxyFunction *func, const char *dir);
+bool		plproxy_limit_set_arg(ProxyFunction *func, const char *ident);
+void		plproxy_aggregate_add(ProxyFunction *func, const char *aggname,
+								  const char *name, int position);
 ProxyFunction *plproxy_compile_and_cache(FunctionCallInfo fcinfo);
 ProxyFunction *plproxy_compile(FunctionCallInfo fcinfo, HeapTuple proc_tuple, bool validate_only);
 
 /* execute.c */
+void		plproxy_exec_init(void);
 void		plproxy_exec(ProxyFunction *func, FunctionCallInfo fcinfo);
+bool		plproxy_stream_fetch(ProxyFunction *func);
+void		plproxy_stream_cancel(ProxyFunction *func);
+void		plproxy_prewarm_cluster(ProxyFunction *func);
 void		plproxy_clean_results(ProxyCluster *cluster);
 void		plproxy_disconnect(ProxyConnectionState *cur);
 
@@ -417,7 +703,7 @@ ProxyType  *plproxy_find_type_info(ProxyFunction *func, Oid oid, bool for_send);
 ProxyType  *plproxy_get_elem_type(ProxyFunction *func, ProxyType *type, bool for_send);
 char	   *plproxy_send_type(ProxyType *type, Datum val, bool allow_bin, int *len, int *fmt);
 Datum		plproxy_recv_type(ProxyType *type, char *str, int len, bool bin);
-HeapTuple	plproxy_recv_composite(ProxyComposite *meta, char **values, int *lengths, int *fmts);
+HeapTuple	plproxy_recv_composite(ProxyComposite *meta);
 void		plproxy_free_type(ProxyType *type);
 void		plproxy_free_composite(ProxyComposite *meta);
 bool		plproxy_composite_valid(ProxyComposite *type);
@@ -427,11 +713,29 @@ void		plproxy_cluster_cache_init(void);
 void		plproxy_syscache_callback_init(void);
 ProxyCluster *plproxy_find_cluster(ProxyFunction *func, FunctionCallInfo fcinfo);
 void		plproxy_cluster_maint(struct timeval * now);
+bool		plproxy_parse_timeout(const char *val, int *ms_p);
 void		plproxy_activate_connection(struct ProxyConnection *conn);
+ProxyResultCol *plproxy_conn_result_map(ProxyConnection *conn, int natts);
 void		plproxy_append_cstr_option(StringInfo cstr, const char *name, const char *val);
+ProxyPreparedStmt *plproxy_find_prepared(ProxyConnectionState *cur, ProxyFunction *func);
+ProxyPreparedStmt *plproxy_new_prepared(ProxyConnectionState *cur, ProxyFunction *func, const char *sql);
+void		plproxy_add_prepared(ProxyConnectionState *cur, ProxyPreparedStmt *stmt);
+void		plproxy_remove_prepared(ProxyConnectionState *cur, ProxyPreparedStmt *stmt);
+void		plproxy_free_prepared(ProxyPreparedStmt *stmt);
+void		plproxy_drop_prepared(ProxyConnectionState *cur);
+void		plproxy_drop_pending(ProxyConnectionState *cur);
+bool		plproxy_prepared_stale(ProxyFunction *func, ProxyPreparedStmt *stmt, const char *sql);
+List	   *plproxy_expired_prepared(ProxyConnectionState *cur);
+void		plproxy_range_prepare(ProxyFunction *func, ProxyCluster *cluster, Oid typid);
 
 /* result.c */
 Datum		plproxy_result(ProxyFunction *func, FunctionCallInfo fcinfo);
+void		plproxy_forget_result_shapes(ProxyFunction *func);
+void		plproxy_result_store(ProxyFunction *func, FunctionCallInfo fcinfo,
+								 Tuplestorestate *tupstore, TupleDesc tupdesc);
+TupleDesc	plproxy_result_desc(ProxyFunction *func);
+void		plproxy_spill_start(ProxyFunction *func, FunctionCallInfo fcinfo);
+void		plproxy_spill_result(ProxyFunction *func, ProxyConnection *conn);
 
 /* query.c */
 QueryBuffer *plproxy_query_start(ProxyFunction *func, bool add_types);
@@ -439,6 +743,7 @@ bool		plproxy_query_add_const(QueryBuffer *q, const char *data);
 bool		plproxy_query_add_ident(QueryBuffer *q, const char *ident);
 ProxyQuery *plproxy_query_finish(QueryBuffer *q);
 ProxyQuery *plproxy_standard_query(ProxyFunction *func, bool add_types);
+void		plproxy_query_add_limit(ProxyFunction *func, ProxyQuery *q);
 void		plproxy_query_prepare(ProxyFunction *func, FunctionCallInfo fcinfo, ProxyQuery *q, bool split_support);
 void		plproxy_query_exec(ProxyFunction *func, FunctionCallInfo fcinfo, ProxyQuery *q,
 							   DatumArray **array_params, int array_row);
@@ -136,6 +136,7 @@ plproxy_query_finish(QueryBuffer *q)
 	len = q->arg_count * sizeof(int);
 	pq->arg_lookup = palloc(len);
 	pq->plan = NULL;
+	pq->typed_result = false;
 
 	memcpy(pq->arg_lookup, q->arg_lookup, len);
 
@@ -169,6 +170,7 @@ plproxy_standard_query(ProxyFunction *func, bool add_types)
 	pq = plproxy_func_alloc(func, sizeof(*pq));
 	pq->sql = NULL;
 	pq->plan = NULL;
+	pq->typed_result = true;
 	pq->arg_count = func->arg_count;
 	len = pq->arg_count * sizeof(int);
 	pq->arg_lookup = plproxy_func_alloc(func, len);
@@ -237,6 +239,50 @@ plproxy_standard_query(ProxyFunction *func, bool add_types)
 	return pq;
 }
 
+/*
+ * Wrap remote query so that each partition returns at most LIMIT rows.
+ *
+ * LIMIT taken from argument is passed as query parameter, added to
+ * arg_lookup if the query does not use it already.
+ */
+void
+plproxy_query_add_limit(ProxyFunction *func, ProxyQuery *q)
+{
+	StringInfoData sql;
+	int			i,
+				sql_idx = -1;
+
+	initStringInfo(&sql);
+	/* newline in case user query ends with comment */
+	appendStringInfo(&sql, "select * from (%s\n) plproxy_limit limit ", q->sql);
+
+	if (func->limit_arg < 0)
+		appendStringInfo(&sql, INT64_FORMAT, func->limit_value);
+	else
+	{
+		for (i = 0; i < q->arg_count; i++)
+		{
+			if (q->arg_lookup[i] == func->limit_arg)
+				sql_idx = i;
+		}
+		if (sql_idx < 0)
+		{
+			int		   *lookup;
+
+			lookup = plproxy_func_alloc(func, (q->arg_count + 1) * sizeof(int));
+			if (q->arg_count > 0)
+				memcpy(lookup, q->arg_lookup, q->arg_count * sizeof(int));
+			sql_idx = q->arg_count++;
+			lookup[sql_idx] = func->limit_arg;
+			q->arg_lookup = lookup;
+		}
+		add_ref(&sql, sql_idx, func, func->limit_arg, true);
+	}
+
+	q->sql = plproxy_func_strdup(func, sql.data);
+	pfree(sql.data);
+}
+
 /*
  * Prepare ProxyQuery for local execution
  */
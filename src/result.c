@@ -37,10 +37,152 @@ name_matches(ProxyFunction *func, const char *aname, PGresult *res, int col)
 	return false;
 }
 
-/* fill func->result_map */
+/* binary value can be decoded only by receive function of same type */
 static void
-map_results(ProxyFunction *func, PGresult *res)
+check_binary_type(ProxyFunction *func, PGresult *res, int col, ProxyType *type)
 {
+	if (PQfformat(res, col) == 1 && PQftype(res, col) != type->type_oid)
+		plproxy_error(func, "Binary result column %d has type %u, expected %s",
+					  col + 1, PQftype(res, col), type->name);
+}
+
+/* find remembered mapping for result with same columns */
+static ProxyResultShape *
+find_shape(ProxyFunction *func, PGresult *res)
+{
+	ProxyResultShape *shape,
+			  **prev;
+	const char *fname;
+	int			nfields = PQnfields(res);
+	int			i;
+
+	for (prev = &func->result_shapes; *prev; prev = &shape->next)
+	{
+		shape = *prev;
+		if (shape->nfields != nfields)
+			continue;
+
+		for (i = 0; i < nfields; i++)
+		{
+			if (PQftype(res, i) != shape->types[i]
+				|| PQfformat(res, i) != shape->fmts[i])
+				break;
+			fname = PQfname(res, i);
+			if (fname == NULL || strcmp(fname, shape->names[i]) != 0)
+				break;
+		}
+		if (i < nfields)
+			continue;
+
+		/* move to front */
+		*prev = shape->next;
+		shape->next = func->result_shapes;
+		func->result_shapes = shape;
+		return shape;
+	}
+	return NULL;
+}
+
+/* remember column mapping for results with same columns */
+static void
+add_shape(ProxyFunction *func, PGresult *res, ProxyResultCol *map)
+{
+	ProxyResultShape *shape;
+	int			nfields = PQnfields(res);
+	int			natts = func->ret_composite->tupdesc->natts;
+	int			i;
+
+	if (func->result_shape_count >= PLPROXY_MAX_RESULT_SHAPES)
+		return;
+
+	shape = plproxy_func_alloc(func, sizeof(*shape));
+	shape->nfields = nfields;
+	shape->types = plproxy_func_alloc(func, nfields * sizeof(Oid));
+	shape->fmts = plproxy_func_alloc(func, nfields * sizeof(int));
+	shape->names = plproxy_func_alloc(func, nfields * sizeof(char *));
+	for (i = 0; i < nfields; i++)
+	{
+		shape->types[i] = PQftype(res, i);
+		shape->fmts[i] = PQfformat(res, i);
+		shape->names[i] = plproxy_func_strdup(func, PQfname(res, i));
+	}
+	shape->map = plproxy_func_alloc(func, natts * sizeof(ProxyResultCol));
+	memcpy(shape->map, map, natts * sizeof(ProxyResultCol));
+
+	shape->next = func->result_shapes;
+	func->result_shapes = shape;
+	func->result_shape_count++;
+}
+
+/* drop remembered mappings, when result type changes */
+void
+plproxy_forget_result_shapes(ProxyFunction *func)
+{
+	ProxyResultShape *shape,
+			   *next;
+	int			i;
+
+	for (shape = func->result_shapes; shape; shape = next)
+	{
+		next = shape->next;
+		for (i = 0; i < shape->nfields; i++)
+			pfree(shape->names[i]);
+		pfree(shape->names);
+		pfree(shape->fmts);
+		pfree(shape->types);
+		pfree(shape->map);
+		pfree(shape);
+	}
+	func->result_shapes = NULL;
+	func->result_shape_count = 0;
+}
+
+/*
+ * Mapping for generated query depends only on result type and
+ * result format, so connection keeps it while they stay same.
+ */
+static void
+map_typed_results(ProxyFunction *func, ProxyConnection *conn, ProxyResultCol *map)
+{
+	PGresult   *res = conn->res;
+	TupleDesc	tupdesc = func->ret_composite->tupdesc;
+	int			nfields = PQnfields(res);
+	int			fmt,
+				i,
+				xi;
+
+	if (nfields < func->ret_composite->nfields)
+		plproxy_error(func, "Got too few fields from remote end");
+	if (nfields > func->ret_composite->nfields)
+		plproxy_error(func, "Got too many fields from remote end");
+
+	/* same format for all columns */
+	fmt = nfields > 0 ? PQfformat(res, 0) : 0;
+	if (conn->result_map_rev == func->result_rev && conn->result_map_fmt == fmt)
+		return;
+
+	for (i = 0, xi = 0; xi < tupdesc->natts; xi++)
+	{
+		if (TupleDescAttr(tupdesc, xi)->attisdropped)
+			map[xi].col = -1;
+		else
+			map[xi].col = i++;
+		map[xi].fmt = fmt;
+	}
+	conn->result_map_rev = func->result_rev;
+	conn->result_map_fmt = fmt;
+}
+
+/*
+ * Fill conn->result_map with column numbers and formats,
+ * once per query.
+ */
+static void
+map_results(ProxyFunction *func, ProxyConnection *conn)
+{
+	PGresult   *res = conn->res;
+	ProxyResultShape *shape;
+	ProxyResultCol *map;
 	int			i,  /* non-dropped column index */
 				xi, /* tupdesc index */
 				j,  /* result column index */
@@ -49,15 +191,40 @@ map_results(ProxyFunction *func, PGresult *res)
 	Form_pg_attribute a;
 	const char *aname;
 
+	/* all results of one query have same columns, eg. streamed chunks */
+	if (conn->result_mapped)
+		return;
+	conn->result_mapped = true;
+
 	if (func->ret_scalar)
 	{
 		if (nfields != 1)
 			plproxy_error(func,
 						  "single field function but got record");
+		if (!func->remote_sql->typed_result)
+			check_binary_type(func, res, 0, func->ret_scalar);
 		return;
 	}
 
 	natts = func->ret_composite->tupdesc->natts;
+	map = plproxy_conn_result_map(conn, natts);
+
+	/* generated query returns columns in tupdesc order */
+	if (func->remote_sql->typed_result)
+	{
+		map_typed_results(func, conn, map);
+		return;
+	}
+	conn->result_map_rev = 0;
+
+	/* same columns as before, skip name matching */
+	shape = find_shape(func, res);
+	if (shape)
+	{
+		memcpy(map, shape->map, natts * sizeof(ProxyResultCol));
+		return;
+	}
+
 	if (nfields < func->ret_composite->nfields)
 		plproxy_error(func, "Got too few fields from remote end");
 	if (nfields > func->ret_composite->nfields)
@@ -68,7 +235,7 @@ map_results(ProxyFunction *func, PGresult *res)
 		/* ->name_list has quoted names, take unquoted from ->tupdesc */
 		a = TupleDescAttr(func->ret_composite->tupdesc, xi);
 
-		func->result_map[xi] = -1;
+		map[xi].col = -1;
 
 		if (a->attisdropped)
 			continue;
@@ -77,7 +244,7 @@ map_results(ProxyFunction *func, PGresult *res)
 		aname = NameStr(a->attname);
 		if (name_matches(func, aname, res, i))
 			/* fast case: 1:1 mapping */
-			func->result_map[xi] = i;
+			map[xi].col = i;
 		else
 		{
 			/* slow case: messed up ordering */
@@ -92,15 +259,19 @@ map_results(ProxyFunction *func, PGresult *res)
 				 */
 				if (name_matches(func, aname, res, j))
 				{
-					func->result_map[xi] = j;
+					map[xi].col = j;
 					break;
 				}
 			}
 		}
-		if (func->result_map[xi] < 0)
+		if (map[xi].col < 0)
 			plproxy_error(func,
 						  "Field %s does not exists in result", aname);
+		map[xi].fmt = PQfformat(res, map[xi].col);
+		check_binary_type(func, res, map[xi].col, func->ret_composite->type_list[xi]);
 	}
+
+	add_shape(func, res, map);
 }
 
 /* Return connection where are unreturned rows */
@@ -120,7 +291,7 @@ walk_results(ProxyFunction *func, ProxyCluster *cluster)
 
 		/* first time on this connection? */
 		if (conn->pos == 0)
-			map_results(func, conn->res);
+			map_results(func, conn);
 
 		return conn;
 	}
@@ -129,63 +300,225 @@ walk_results(ProxyFunction *func, ProxyCluster *cluster)
 	return NULL;
 }
 
-/* Return a tuple */
-static Datum
-return_composite(ProxyFunction *func, ProxyConnection *conn, FunctionCallInfo fcinfo)
+/*
+ * ORDER BY: k-way merge of sorted partition results.
+ *
+ * Heap contains active_list positions of connections that have
+ * unreturned rows, ordered by sort keys of their current row.
+ */
+
+/* decode sort keys of current row */
+static void
+merge_decode(ProxyFunction *func, ProxyCluster *cluster, int idx)
 {
-	int			i,
+	ProxyConnection *conn = cluster->active_list[idx];
+	Datum	   *values = cluster->merge_values + idx * func->order_count;
+	bool	   *nulls = cluster->merge_nulls + idx * func->order_count;
+	ProxyOrderKey *key;
+	MemoryContext old_ctx;
+	int			k,
 				col;
-	char	  **values;
-	int		   *fmts;
-	int		   *lengths;
-	HeapTuple	tup;
-	ProxyComposite *meta = func->ret_composite;
 
-	values = palloc(meta->tupdesc->natts * sizeof(char *));
-	fmts = palloc(meta->tupdesc->natts * sizeof(int));
-	lengths = palloc(meta->tupdesc->natts * sizeof(int));
+	if (conn->pos == 0)
+		map_results(func, conn);
 
-	for (i = 0; i < meta->tupdesc->natts; i++)
+	old_ctx = MemoryContextSwitchTo(cluster->merge_ctx);
+	for (k = 0; k < func->order_count; k++)
 	{
-		col = func->result_map[i];
+		key = &func->order_keys[k];
+
+		/* release previous row */
+		if (!nulls[k] && !key->type->by_value)
+			pfree(DatumGetPointer(values[k]));
+
+		col = func->ret_composite ? conn->result_map[key->attno].col : 0;
 		if (col < 0 || PQgetisnull(conn->res, conn->pos, col))
 		{
-			values[i] = NULL;
-			lengths[i] = 0;
-			fmts[i] = 0;
+			values[k] = (Datum) 0;
+			nulls[k] = true;
 		}
 		else
 		{
-			values[i] = PQgetvalue(conn->res, conn->pos, col);
-			lengths[i] = PQgetlength(conn->res, conn->pos, col);
-			fmts[i] = PQfformat(conn->res, col);
+			values[k] = plproxy_recv_type(key->type,
+										  PQgetvalue(conn->res, conn->pos, col),
+										  PQgetlength(conn->res, conn->pos, col),
+										  PQfformat(conn->res, col));
+			nulls[k] = false;
 		}
 	}
-	tup = plproxy_recv_composite(meta, values, lengths, fmts);
+	MemoryContextSwitchTo(old_ctx);
+}
 
-	pfree(lengths);
-	pfree(fmts);
-	pfree(values);
+/* compare current rows, equal ones are returned in partition order */
+static int
+merge_cmp(ProxyFunction *func, ProxyCluster *cluster, int a, int b)
+{
+	int			n = func->order_count;
+	int			k,
+				res;
 
-	return HeapTupleGetDatum(tup);
+	for (k = 0; k < n; k++)
+	{
+		res = ApplySortComparator(cluster->merge_values[a * n + k],
+								  cluster->merge_nulls[a * n + k],
+								  cluster->merge_values[b * n + k],
+								  cluster->merge_nulls[b * n + k],
+								  &func->order_keys[k].ssup);
+		if (res != 0)
+			return res;
+	}
+	return a - b;
 }
 
-/* Return scalar value */
+static void
+merge_sift_down(ProxyFunction *func, ProxyCluster *cluster, int i)
+{
+	int		   *heap = cluster->merge_heap;
+	int			n = cluster->merge_count;
+	int			item = heap[i];
+	int			child;
+
+	while ((child = 2 * i + 1) < n)
+	{
+		if (child + 1 < n && merge_cmp(func, cluster, heap[child + 1], heap[child]) < 0)
+			child++;
+		if (merge_cmp(func, cluster, item, heap[child]) <= 0)
+			break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = item;
+}
+
+/* build heap from first rows of all connections */
+static void
+merge_start(ProxyFunction *func, ProxyCluster *cluster)
+{
+	ProxyConnection *conn;
+	int			n = cluster->active_count * func->order_count;
+	int			i;
+
+	if (n > cluster->merge_alloc)
+	{
+		if (cluster->merge_heap)
+		{
+			pfree(cluster->merge_heap);
+			pfree(cluster->merge_values);
+			pfree(cluster->merge_nulls);
+		}
+		cluster->merge_heap = MemoryContextAlloc(TopMemoryContext, n * sizeof(int));
+		cluster->merge_values = MemoryContextAlloc(TopMemoryContext, n * sizeof(Datum));
+		cluster->merge_nulls = MemoryContextAlloc(TopMemoryContext, n * sizeof(bool));
+		cluster->merge_alloc = n;
+	}
+	if (!cluster->merge_ctx)
+		cluster->merge_ctx = AllocSetContextCreate(TopMemoryContext,
+												   "PL/Proxy merge context",
+												   ALLOCSET_SMALL_SIZES);
+
+	memset(cluster->merge_nulls, 1, n * sizeof(bool));
+	cluster->merge_count = 0;
+	for (i = 0; i < cluster->active_count; i++)
+	{
+		conn = cluster->active_list[i];
+		if (conn->res == NULL || conn->pos >= PQntuples(conn->res))
+			continue;
+
+		merge_decode(func, cluster, i);
+		cluster->merge_heap[cluster->merge_count++] = i;
+	}
+
+	for (i = cluster->merge_count / 2 - 1; i >= 0; i--)
+		merge_sift_down(func, cluster, i);
+
+	cluster->merge_init = true;
+}
+
+/*
+ * Return connection with smallest row.
+ *
+ * Top row was returned on previous call, so top
+ * connection is moved to next row first.
+ */
+static ProxyConnection *
+merge_next(ProxyFunction *func, ProxyCluster *cluster)
+{
+	ProxyConnection *conn;
+	int			idx;
+
+	if (!cluster->merge_init)
+		merge_start(func, cluster);
+	else if (cluster->merge_count > 0)
+	{
+		idx = cluster->merge_heap[0];
+		conn = cluster->active_list[idx];
+		if (conn->res && conn->pos < PQntuples(conn->res))
+			merge_decode(func, cluster, idx);
+		else
+			cluster->merge_heap[0] = cluster->merge_heap[--cluster->merge_count];
+		if (cluster->merge_count > 0)
+			merge_sift_down(func, cluster, 0);
+	}
+
+	if (cluster->merge_count == 0)
+		plproxy_error(func, "bug: no result");
+	return cluster->active_list[cluster->merge_heap[0]];
+}
+
+/* Decode current row into tuple */
+static HeapTuple
+recv_row(ProxyFunction *func, ProxyConnection *conn)
+{
+	ProxyComposite *meta = func->ret_composite;
+	ProxyResultCol *rc = conn->result_map;
+	PGresult   *res = conn->res;
+	int			row = conn->pos;
+	int			natts = meta->tupdesc->natts;
+	int			i;
+
+	/* fill scratch buffers, only tuple itself is allocated */
+	for (i = 0; i < natts; i++, rc++)
+	{
+		if (rc->col < 0 || PQgetisnull(res, row, rc->col))
+		{
+			meta->values[i] = NULL;
+			meta->lengths[i] = 0;
+			meta->fmts[i] = 0;
+		}
+		else
+		{
+			meta->values[i] = PQgetvalue(res, row, rc->col);
+			meta->lengths[i] = PQgetlength(res, row, rc->col);
+			meta->fmts[i] = rc->fmt;
+		}
+	}
+	return plproxy_recv_composite(meta);
+}
+
+/* Return a tuple */
 static Datum
-return_scalar(ProxyFunction *func, ProxyConnection *conn, FunctionCallInfo fcinfo)
+return_composite(ProxyFunction *func, ProxyConnection *conn, FunctionCallInfo fcinfo)
+{
+	return HeapTupleGetDatum(recv_row(func, conn));
+}
+
+/* Decode current row as scalar value */
+static Datum
+recv_scalar(ProxyFunction *func, ProxyConnection *conn, bool *isnull)
 {
 	Datum		dat;
 	char	   *val;
 	PGresult   *res = conn->res;
 	int			row = conn->pos;
 
+	*isnull = false;
 	if (func->ret_scalar->type_oid == VOIDOID)
 	{
 		dat = (Datum) NULL;
 	}
 	else if (PQgetisnull(res, row, 0))
 	{
-		fcinfo->isnull = true;
+		*isnull = true;
 		dat = (Datum) NULL;
 	}
 	else
@@ -200,6 +533,124 @@ return_scalar(ProxyFunction *func, ProxyConnection *conn, FunctionCallInfo fcinf
 	return dat;
 }
 
+/* Return scalar value */
+static Datum
+return_scalar(ProxyFunction *func, ProxyConnection *conn, FunctionCallInfo fcinfo)
+{
+	Datum		dat;
+	bool		isnull;
+
+	dat = recv_scalar(func, conn, &isnull);
+	if (isnull)
+		fcinfo->isnull = true;
+	return dat;
+}
+
+/*
+ * AGGREGATE: combine partial results from all rows into values
+ * of result columns.  Each result is released when done.
+ *
+ * NULL partial results are ignored, column stays NULL if
+ * there is nothing else.
+ */
+static void
+aggregate_rows(ProxyFunction *func, ProxyCluster *cluster,
+			   Datum *values, bool *nulls, int natts)
+{
+	ProxyConnection *conn;
+	ProxyAggregate *agg;
+	MemoryContext row_ctx,
+				old_ctx;
+	Datum		val;
+	int			i,
+				k,
+				col;
+
+	for (i = 0; i < natts; i++)
+	{
+		values[i] = (Datum) 0;
+		nulls[i] = true;
+	}
+
+	/* like count() in PostgreSQL, count of no rows is 0, not NULL */
+	for (k = 0; k < func->agg_count; k++)
+	{
+		agg = &func->aggs[k];
+		if (!agg->is_count)
+			continue;
+		values[agg->attno] = plproxy_recv_type(agg->type, "0", 1, false);
+		nulls[agg->attno] = false;
+	}
+
+	/* decoding and combine garbage is freed after each row */
+	row_ctx = AllocSetContextCreate(CurrentMemoryContext,
+									"PL/Proxy aggregate context",
+									ALLOCSET_SMALL_SIZES);
+
+	for (i = 0; i < cluster->active_count; i++)
+	{
+		conn = cluster->active_list[i];
+		if (conn->res == NULL)
+			continue;
+
+		map_results(func, conn);
+		for (; conn->pos < PQntuples(conn->res); conn->pos++)
+		{
+			for (k = 0; k < func->agg_count; k++)
+			{
+				agg = &func->aggs[k];
+				col = func->ret_composite ? conn->result_map[agg->attno].col : 0;
+				if (PQgetisnull(conn->res, conn->pos, col))
+					continue;
+
+				old_ctx = MemoryContextSwitchTo(row_ctx);
+				val = plproxy_recv_type(agg->type,
+										PQgetvalue(conn->res, conn->pos, col),
+										PQgetlength(conn->res, conn->pos, col),
+										PQfformat(conn->res, col));
+				if (!nulls[agg->attno])
+					val = FunctionCall2Coll(&agg->combine, agg->collation,
+											values[agg->attno], val);
+				MemoryContextSwitchTo(old_ctx);
+
+				if (!nulls[agg->attno] && !agg->type->by_value)
+					pfree(DatumGetPointer(values[agg->attno]));
+				values[agg->attno] = datumCopy(val, agg->type->by_value, agg->type->length);
+				nulls[agg->attno] = false;
+
+				MemoryContextReset(row_ctx);
+			}
+		}
+
+		PQclear(conn->res);
+		conn->res = NULL;
+	}
+
+	MemoryContextDelete(row_ctx);
+}
+
+/* AGGREGATE: return the combined row */
+static Datum
+return_aggregate(ProxyFunction *func, FunctionCallInfo fcinfo)
+{
+	ProxyComposite *meta = func->ret_composite;
+	ProxyCluster *cluster = func->cur_cluster;
+	Datum		dat;
+	bool		isnull;
+
+	cluster->ret_total = 0;
+
+	if (meta)
+	{
+		aggregate_rows(func, cluster, meta->dvalues, meta->nulls, meta->tupdesc->natts);
+		return HeapTupleGetDatum(heap_form_tuple(meta->tupdesc, meta->dvalues, meta->nulls));
+	}
+
+	aggregate_rows(func, cluster, &dat, &isnull, 1);
+	fcinfo->isnull = isnull;
+	return dat;
+}
+
 /* Return next result Datum */
 Datum
 plproxy_result(ProxyFunction *func, FunctionCallInfo fcinfo)
@@ -208,7 +659,13 @@ plproxy_result(ProxyFunction *func, FunctionCallInfo fcinfo)
 	ProxyCluster *cluster = func->cur_cluster;
 	ProxyConnection *conn;
 
-	conn = walk_results(func, cluster);
+	if (func->agg_count > 0)
+		return return_aggregate(func, fcinfo);
+
+	if (func->order_count > 0)
+		conn = merge_next(func, cluster);
+	else
+		conn = walk_results(func, cluster);
 
 	if (func->ret_composite)
 		dat = return_composite(func, conn, fcinfo);
@@ -218,5 +675,176 @@ plproxy_result(ProxyFunction *func, FunctionCallInfo fcinfo)
 	cluster->ret_total--;
 	conn->pos++;
 
+	/* streaming: stop when LIMIT is reached */
+	if (cluster->ret_limit > 0)
+		cluster->ret_limit--;
+
 	return dat;
 }
+
+/* Materialize mode: add current row to tuplestore */
+static void
+store_row(ProxyFunction *func, ProxyConnection *conn,
+		  Tuplestorestate *tupstore, TupleDesc tupdesc, MemoryContext row_ctx)
+{
+	MemoryContext old_ctx;
+	Datum		dat;
+	bool		isnull;
+
+	old_ctx = MemoryContextSwitchTo(row_ctx);
+	if (func->ret_composite)
+		tuplestore_puttuple(tupstore, recv_row(func, conn));
+	else
+	{
+		dat = recv_scalar(func, conn, &isnull);
+		tuplestore_putvalues(tupstore, tupdesc, &dat, &isnull);
+	}
+	MemoryContextSwitchTo(old_ctx);
+	MemoryContextReset(row_ctx);
+
+	conn->pos++;
+	func->cur_cluster->ret_total--;
+
+	/* all rows stored, release it */
+	if (conn->pos == PQntuples(conn->res))
+	{
+		PQclear(conn->res);
+		conn->res = NULL;
+	}
+}
+
+/*
+ * Materialize mode: decode all rows into tuplestore.
+ *
+ * Each PGresult is freed as soon as its rows are stored,
+ * so the libpq copy and tuplestore copy of whole result
+ * do not exist at the same time.
+ */
+void
+plproxy_result_store(ProxyFunction *func, FunctionCallInfo fcinfo,
+					 Tuplestorestate *tupstore, TupleDesc tupdesc)
+{
+	ProxyCluster *cluster = func->cur_cluster;
+	ProxyComposite *meta;
+	ProxyConnection *conn;
+	MemoryContext row_ctx;
+	Datum		dat;
+	bool		isnull;
+	int			i;
+
+	/* decoding garbage is freed after each row */
+	row_ctx = AllocSetContextCreate(CurrentMemoryContext,
+									"PL/Proxy row context",
+									ALLOCSET_SMALL_SIZES);
+
+	if (func->agg_count > 0)
+	{
+		if (func->ret_composite)
+		{
+			meta = func->ret_composite;
+			aggregate_rows(func, cluster, meta->dvalues, meta->nulls, meta->tupdesc->natts);
+			tuplestore_putvalues(tupstore, tupdesc, meta->dvalues, meta->nulls);
+		}
+		else
+		{
+			aggregate_rows(func, cluster, &dat, &isnull, 1);
+			tuplestore_putvalues(tupstore, tupdesc, &dat, &isnull);
+		}
+		cluster->ret_total = 0;
+	}
+	else if (func->order_count > 0)
+	{
+		while (cluster->ret_total > 0)
+			store_row(func, merge_next(func, cluster),
+					  tupstore, tupdesc, row_ctx);
+	}
+	else
+	{
+		/* ret_total is LIMIT-ed, so it may stop before rows run out */
+		for (i = 0; i < cluster->active_count && cluster->ret_total > 0; i++)
+		{
+			conn = cluster->active_list[i];
+			if (conn->res == NULL || conn->pos >= PQntuples(conn->res))
+				continue;
+
+			map_results(func, conn);
+			while (conn->res && cluster->ret_total > 0)
+				store_row(func, conn, tupstore, tupdesc, row_ctx);
+		}
+	}
+
+	fcinfo->isnull = false;
+	MemoryContextDelete(row_ctx);
+}
+
+/*
+ * Describe result rows for tuplestore.  Allocated in
+ * CurrentMemoryContext, executor frees it as setDesc.
+ */
+TupleDesc
+plproxy_result_desc(ProxyFunction *func)
+{
+	TupleDesc	tupdesc;
+
+	if (func->ret_composite)
+		return CreateTupleDescCopy(func->ret_composite->tupdesc);
+
+	tupdesc = CreateTemplateTupleDesc(1);
+	TupleDescInitEntry(tupdesc, (AttrNumber) 1, func->name,
+					   func->ret_scalar->type_oid, -1, 0);
+	return tupdesc;
+}
+
+/*
+ * result_memory_limit: prepare tuplestore that receives rows
+ * while they arrive.  It is given to executor at the end,
+ * so it lives in per-query memory.
+ */
+void
+plproxy_spill_start(ProxyFunction *func, FunctionCallInfo fcinfo)
+{
+	ReturnSetInfo *rsi = (ReturnSetInfo *) fcinfo->resultinfo;
+	ProxyCluster *cluster = func->cur_cluster;
+	MemoryContext old_ctx;
+
+	old_ctx = MemoryContextSwitchTo(rsi->econtext->ecxt_per_query_memory);
+	cluster->spill_desc = plproxy_result_desc(func);
+	cluster->spill_store = tuplestore_begin_heap(rsi->allowedModes & SFRM_Materialize_Random,
+												 false, cluster->config.result_memory_limit);
+	MemoryContextSwitchTo(old_ctx);
+
+	if (!cluster->spill_ctx)
+		cluster->spill_ctx = AllocSetContextCreate(TopMemoryContext,
+												   "PL/Proxy spill context",
+												   ALLOCSET_SMALL_SIZES);
+	cluster->spill = true;
+}
+
+/*
+ * result_memory_limit: move rows of just received chunk into
+ * tuplestore and release the chunk.  Tuplestore itself
+ * goes to disk when it grows over the limit.
+ */
+void
+plproxy_spill_result(ProxyFunction *func, ProxyConnection *conn)
+{
+	ProxyCluster *cluster = func->cur_cluster;
+	int			rows = PQntuples(conn->res);
+
+	conn->pos = 0;
+	if (rows == 0)
+	{
+		PQclear(conn->res);
+		conn->res = NULL;
+		return;
+	}
+
+	/* store_row() counts them down */
+	cluster->ret_total += rows;
+
+	map_results(func, conn);
+	while (conn->res)
+		store_row(func, conn, cluster->spill_store, cluster->spill_desc,
+				  cluster->spill_ctx);
+	conn->pos = 0;
+}
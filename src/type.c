@@ -28,18 +28,11 @@
 static bool usable_binary(Oid oid)
 {
 	/*
-	 * We need to properly track if remote server has:
-	 * - same major:minor version
-	 * - same server_encoding
-	 * - same integer_timestamps
-	 *
-	 * Currently plproxy does the decision too early,
-	 * thus no safe types are left.  Disable is totally,
-	 * until lazy decision-making is possible.
+	 * Binary is used only with connections to same major:minor
+	 * version, decided per connection in send_query().
+	 * Types that depend on server_encoding or
+	 * integer_timestamps stay in text.
 	 */
-	if (1)
-		return false;
-
 	switch (oid)
 	{
 		case BOOLOID:
@@ -70,6 +63,425 @@ static bool usable_binary(Oid oid)
 	}
 }
 
+/*
+ * Fast I/O for common fixed-width types.
+ *
+ * Text decoders accept only canonical output of the type,
+ * anything else goes to the real input function, which
+ * also gives proper error messages.
+ */
+
+/* parse [-]digits, up to 18 digits so it cannot overflow */
+static bool
+parse_int_text(const char *s, int len, int64 min, int64 max, int64 *res)
+{
+	const char *end = s + len;
+	bool		neg = false;
+	int64		val = 0;
+
+	if (s < end && *s == '-')
+	{
+		neg = true;
+		s++;
+	}
+	if (s == end || end - s > 18)
+		return false;
+	for (; s < end; s++)
+	{
+		if (*s < '0' || *s > '9')
+			return false;
+		val = val * 10 + (*s - '0');
+	}
+	if (neg)
+		val = -val;
+	if (val < min || val > max)
+		return false;
+	*res = val;
+	return true;
+}
+
+static bool
+recv_int2_text(const char *val, int len, Datum *res)
+{
+	int64		v;
+
+	if (!parse_int_text(val, len, PG_INT16_MIN, PG_INT16_MAX, &v))
+		return false;
+	*res = Int16GetDatum((int16) v);
+	return true;
+}
+
+static bool
+recv_int4_text(const char *val, int len, Datum *res)
+{
+	int64		v;
+
+	if (!parse_int_text(val, len, PG_INT32_MIN, PG_INT32_MAX, &v))
+		return false;
+	*res = Int32GetDatum((int32) v);
+	return true;
+}
+
+static bool
+recv_int8_text(const char *val, int len, Datum *res)
+{
+	int64		v;
+
+	if (!parse_int_text(val, len, PG_INT64_MIN, PG_INT64_MAX, &v))
+		return false;
+	*res = Int64GetDatum(v);
+	return true;
+}
+
+static bool
+recv_oid_text(const char *val, int len, Datum *res)
+{
+	int64		v;
+
+	if (!parse_int_text(val, len, 0, PG_UINT32_MAX, &v))
+		return false;
+	*res = ObjectIdGetDatum((Oid) v);
+	return true;
+}
+
+static bool
+recv_bool_text(const char *val, int len, Datum *res)
+{
+	if (len != 1 || (val[0] != 't' && val[0] != 'f'))
+		return false;
+	*res = BoolGetDatum(val[0] == 't');
+	return true;
+}
+
+/* backend runs with LC_NUMERIC=C, like float8in() */
+static bool
+recv_float8_text(const char *val, int len, Datum *res)
+{
+	char	   *end;
+	double		v;
+
+	if (len == 0)
+		return false;
+	errno = 0;
+	v = strtod(val, &end);
+	if (errno != 0 || end != val + len)
+		return false;
+	*res = Float8GetDatum(v);
+	return true;
+}
+
+static int
+hex_value(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+/* only xxxxxxxx-xxxx-xxxx-xxxx-xxxxxxxxxxxx form */
+static bool
+recv_uuid_text(const char *val, int len, Datum *res)
+{
+	pg_uuid_t	tmp;
+	pg_uuid_t  *uuid;
+	int			i,
+				hi,
+				lo;
+
+	if (len != 36)
+		return false;
+	for (i = 0; i < UUID_LEN; i++)
+	{
+		if (*val == '-' && (i == 4 || i == 6 || i == 8 || i == 10))
+			val++;
+		hi = hex_value(val[0]);
+		lo = hex_value(val[1]);
+		if (hi < 0 || lo < 0)
+			return false;
+		tmp.data[i] = (hi << 4) | lo;
+		val += 2;
+	}
+
+	uuid = palloc(sizeof(*uuid));
+	memcpy(uuid, &tmp, sizeof(tmp));
+	*res = UUIDPGetDatum(uuid);
+	return true;
+}
+
+/* binary values are in network byte order */
+static uint32
+get_uint32(const char *val)
+{
+	const unsigned char *p = (const unsigned char *) val;
+
+	return ((uint32) p[0] << 24) | ((uint32) p[1] << 16) | ((uint32) p[2] << 8) | p[3];
+}
+
+static uint64
+get_uint64(const char *val)
+{
+	return ((uint64) get_uint32(val) << 32) | get_uint32(val + 4);
+}
+
+static bool
+recv_int2_bin(const char *val, int len, Datum *res)
+{
+	const unsigned char *p = (const unsigned char *) val;
+
+	if (len != 2)
+		return false;
+	*res = Int16GetDatum((int16) ((p[0] << 8) | p[1]));
+	return true;
+}
+
+static bool
+recv_int4_bin(const char *val, int len, Datum *res)
+{
+	if (len != 4)
+		return false;
+	*res = Int32GetDatum((int32) get_uint32(val));
+	return true;
+}
+
+static bool
+recv_int8_bin(const char *val, int len, Datum *res)
+{
+	if (len != 8)
+		return false;
+	*res = Int64GetDatum((int64) get_uint64(val));
+	return true;
+}
+
+static bool
+recv_bool_bin(const char *val, int len, Datum *res)
+{
+	if (len != 1)
+		return false;
+	*res = BoolGetDatum(val[0] != 0);
+	return true;
+}
+
+static bool
+recv_float4_bin(const char *val, int len, Datum *res)
+{
+	union { uint32 i; float4 f; } u;
+
+	if (len != 4)
+		return false;
+	u.i = get_uint32(val);
+	*res = Float4GetDatum(u.f);
+	return true;
+}
+
+static bool
+recv_float8_bin(const char *val, int len, Datum *res)
+{
+	union { uint64 i; float8 f; } u;
+
+	if (len != 8)
+		return false;
+	u.i = get_uint64(val);
+	*res = Float8GetDatum(u.f);
+	return true;
+}
+
+static void
+put_uint32(char *buf, uint32 v)
+{
+	unsigned char *p = (unsigned char *) buf;
+
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static void
+put_uint64(char *buf, uint64 v)
+{
+	put_uint32(buf, (uint32) (v >> 32));
+	put_uint32(buf + 4, (uint32) v);
+}
+
+static char *
+send_bool_bin(Datum val, int *len)
+{
+	char	   *buf = palloc(1);
+
+	buf[0] = DatumGetBool(val) ? 1 : 0;
+	*len = 1;
+	return buf;
+}
+
+static char *
+send_int2_bin(Datum val, int *len)
+{
+	unsigned char *buf = palloc(2);
+	uint16		v = (uint16) DatumGetInt16(val);
+
+	buf[0] = v >> 8;
+	buf[1] = v;
+	*len = 2;
+	return (char *) buf;
+}
+
+static char *
+send_int4_bin(Datum val, int *len)
+{
+	char	   *buf = palloc(4);
+
+	put_uint32(buf, (uint32) DatumGetInt32(val));
+	*len = 4;
+	return buf;
+}
+
+static char *
+send_int8_bin(Datum val, int *len)
+{
+	char	   *buf = palloc(8);
+
+	put_uint64(buf, (uint64) DatumGetInt64(val));
+	*len = 8;
+	return buf;
+}
+
+static char *
+send_float4_bin(Datum val, int *len)
+{
+	union { uint32 i; float4 f; } u;
+	char	   *buf = palloc(4);
+
+	u.f = DatumGetFloat4(val);
+	put_uint32(buf, u.i);
+	*len = 4;
+	return buf;
+}
+
+static char *
+send_float8_bin(Datum val, int *len)
+{
+	union { uint64 i; float8 f; } u;
+	char	   *buf = palloc(8);
+
+	u.f = DatumGetFloat8(val);
+	put_uint64(buf, u.i);
+	*len = 8;
+	return buf;
+}
+
+static char *
+send_int2_text(Datum val)
+{
+	char	   *buf = palloc(8);
+
+	pg_itoa(DatumGetInt16(val), buf);
+	return buf;
+}
+
+static char *
+send_int4_text(Datum val)
+{
+	char	   *buf = palloc(12);
+
+	pg_ltoa(DatumGetInt32(val), buf);
+	return buf;
+}
+
+static char *
+send_int8_text(Datum val)
+{
+	char	   *buf = palloc(24);
+
+	pg_lltoa(DatumGetInt64(val), buf);
+	return buf;
+}
+
+static char *
+send_oid_text(Datum val)
+{
+	char	   *buf = palloc(12);
+
+	snprintf(buf, 12, "%u", DatumGetObjectId(val));
+	return buf;
+}
+
+static char *
+send_bool_text(Datum val)
+{
+	return pstrdup(DatumGetBool(val) ? "t" : "f");
+}
+
+static char *
+send_uuid_text(Datum val)
+{
+	static const char hex[] = "0123456789abcdef";
+	pg_uuid_t  *uuid = DatumGetUUIDP(val);
+	char	   *buf = palloc(2 * UUID_LEN + 5);
+	char	   *p = buf;
+	int			i;
+
+	for (i = 0; i < UUID_LEN; i++)
+	{
+		if (i == 4 || i == 6 || i == 8 || i == 10)
+			*p++ = '-';
+		*p++ = hex[uuid->data[i] >> 4];
+		*p++ = hex[uuid->data[i] & 15];
+	}
+	*p = '\0';
+	return buf;
+}
+
+/*
+ * Float output depends on extra_float_digits, timestamps on
+ * DateStyle and TimeZone, so those use I/O functions.
+ */
+static const struct FastIO
+{
+	Oid			oid;
+	bool		(*recv_text) (const char *val, int len, Datum *res);
+	bool		(*recv_bin) (const char *val, int len, Datum *res);
+	char	   *(*send_text) (Datum val);
+	char	   *(*send_bin) (Datum val, int *len);
+} fast_io_list[] = {
+	{ BOOLOID, recv_bool_text, recv_bool_bin, send_bool_text, send_bool_bin },
+	{ INT2OID, recv_int2_text, recv_int2_bin, send_int2_text, send_int2_bin },
+	{ INT4OID, recv_int4_text, recv_int4_bin, send_int4_text, send_int4_bin },
+	{ INT8OID, recv_int8_text, recv_int8_bin, send_int8_text, send_int8_bin },
+	{ OIDOID, recv_oid_text, NULL, send_oid_text, NULL },
+	{ FLOAT4OID, NULL, recv_float4_bin, NULL, send_float4_bin },
+	{ FLOAT8OID, recv_float8_text, recv_float8_bin, NULL, send_float8_bin },
+	{ UUIDOID, recv_uuid_text, NULL, send_uuid_text, NULL },
+};
+
+static void
+set_fast_io(ProxyType *type)
+{
+	int			i;
+
+	for (i = 0; i < lengthof(fast_io_list); i++)
+	{
+		if (fast_io_list[i].oid != type->type_oid)
+			continue;
+		if (type->for_send)
+		{
+			type->fast_send_text = fast_io_list[i].send_text;
+			if (type->has_send)
+				type->fast_send_bin = fast_io_list[i].send_bin;
+		}
+		else
+		{
+			type->fast_recv_text = fast_io_list[i].recv_text;
+			if (type->has_recv)
+				type->fast_recv_bin = fast_io_list[i].recv_bin;
+		}
+		break;
+	}
+}
+
 bool
 plproxy_composite_valid(ProxyComposite *type)
 {
@@ -119,6 +531,11 @@ plproxy_composite_info(ProxyFunction *func, TupleDesc tupdesc)
 	ret = palloc(sizeof(*ret));
 	ret->type_list = palloc(sizeof(ProxyType *) * natts);
 	ret->name_list = palloc0(sizeof(char *) * natts);
+	ret->values = palloc(sizeof(char *) * natts);
+	ret->lengths = palloc(sizeof(int) * natts);
+	ret->fmts = palloc(sizeof(int) * natts);
+	ret->dvalues = palloc(sizeof(Datum) * natts);
+	ret->nulls = palloc(sizeof(bool) * natts);
 	ret->tupdesc = BlessTupleDesc(tupdesc);
 	ret->use_binary = 1;
 
@@ -186,6 +603,11 @@ plproxy_free_composite(ProxyComposite *rec)
 	}
 	pfree(rec->type_list);
 	pfree(rec->name_list);
+	pfree(rec->values);
+	pfree(rec->lengths);
+	pfree(rec->fmts);
+	pfree(rec->dvalues);
+	pfree(rec->nulls);
 	FreeTupleDesc(rec->tupdesc);
 	pfree(rec);
 }
@@ -208,23 +630,24 @@ plproxy_free_type(ProxyType *type)
 }
 
 /*
- * Build result tuple from binary or CString values.
+ * Build result tuple from binary or CString values
+ * in meta->values, meta->lengths and meta->fmts.
  *
  * Based on BuildTupleFromCStrings.
  */
 HeapTuple
-plproxy_recv_composite(ProxyComposite *meta, char **values, int *lengths, int *fmts)
+plproxy_recv_composite(ProxyComposite *meta)
 {
 	TupleDesc	tupdesc = meta->tupdesc;
 	int			natts = tupdesc->natts;
-	Datum	   *dvalues;
-	bool	   *nulls;
+	char	  **values = meta->values;
+	int		   *lengths = meta->lengths;
+	int		   *fmts = meta->fmts;
+	Datum	   *dvalues = meta->dvalues;
+	bool	   *nulls = meta->nulls;
 	int			i;
 	HeapTuple	tuple;
 
-	dvalues = (Datum *) palloc(natts * sizeof(Datum));
-	nulls = (bool *) palloc(natts * sizeof(bool));
-
 	/* Call the recv function for each attribute */
 	for (i = 0; i < natts; i++)
 	{
@@ -254,8 +677,6 @@ plproxy_recv_composite(ProxyComposite *meta, char **values, int *lengths, int *f
 			continue;
 		pfree(DatumGetPointer(dvalues[i]));
 	}
-	pfree(dvalues);
-	pfree(nulls);
 
 	return tuple;
 }
@@ -351,6 +772,8 @@ plproxy_find_type_info(ProxyFunction *func, Oid oid, bool for_send)
 		}
 	}
 
+	set_fast_io(type);
+
 	ReleaseSysCache(t_type);
 
 	return type;
@@ -375,14 +798,22 @@ plproxy_send_type(ProxyType *type, Datum val, bool allow_bin, int *len, int *fmt
 
 	if (allow_bin && type->has_send)
 	{
-		bin = SendFunctionCall(&type->io.out.send_func, val);
-		res = VARDATA(bin);
-		*len = VARSIZE(bin) - VARHDRSZ;
+		if (type->fast_send_bin)
+			res = type->fast_send_bin(val, len);
+		else
+		{
+			bin = SendFunctionCall(&type->io.out.send_func, val);
+			res = VARDATA(bin);
+			*len = VARSIZE(bin) - VARHDRSZ;
+		}
 		*fmt = 1;
 	}
 	else
 	{
-		res = OutputFunctionCall(&type->io.out.output_func, val);
+		if (type->fast_send_text)
+			res = type->fast_send_text(val);
+		else
+			res = OutputFunctionCall(&type->io.out.output_func, val);
 		*len = 0;
 		*fmt = 0;
 	}
@@ -420,6 +851,9 @@ plproxy_recv_type(ProxyType *type, char *val, int len, bool bin)
 		if (!type->has_recv)
 			elog(ERROR, "PL/Proxy: type %u recv not supported", type->type_oid);
 
+		if (type->fast_recv_bin && type->fast_recv_bin(val, len, &res))
+			return res;
+
 		/* avoid unnecessary copy */
 		setFixedStringInfo(&buf, val, len);
 
@@ -428,6 +862,9 @@ plproxy_recv_type(ProxyType *type, char *val, int len, bool bin)
 	}
 	else
 	{
+		if (type->fast_recv_text && type->fast_recv_text(val, len, &res))
+			return res;
+
 		res = InputFunctionCall(&type->io.in.input_func,
 								val, type->io_param, -1);
 	}
@@ -0,0 +1,99 @@
+\set VERBOSITY terse
+set client_min_messages = 'warning';
+
+create server aggcluster foreign data wrapper plproxy
+    options (
+        partition_0 'dbname=test_part0 host=localhost',
+        partition_1 'dbname=test_part1 host=localhost'
+    );
+create user mapping for public server aggcluster;
+
+-- partitions return partial results
+\c test_part0
+create function agg_stats(out cnt int8, out total numeric, out last date, out name text) as $$
+    select 3::int8, 10.5::numeric, '2024-01-02'::date, 'beta'::text;
+$$ language sql;
+create function agg_vals() returns setof int4 as $$
+    select generate_series(1, 3);
+$$ language sql;
+\c test_part1
+create function agg_stats(out cnt int8, out total numeric, out last date, out name text) as $$
+    select 4::int8, null::numeric, '2024-03-01'::date, 'alpha'::text;
+$$ language sql;
+create function agg_vals() returns setof int4 as $$
+    select 10;
+$$ language sql;
+\c regression
+
+create function agg_stats(out cnt int8, out total numeric, out last date, out name text) as $$
+    cluster 'aggcluster';
+    run on all;
+    aggregate max(last), sum(cnt), min(name), sum(total);
+$$ language plproxy;
+
+create function agg_vals() returns setof int4 as $$
+    cluster 'aggcluster';
+    run on all;
+    aggregate sum(1);
+$$ language plproxy;
+
+create function agg_max() returns setof int4 as $$
+    cluster 'aggcluster';
+    run on all;
+    aggregate /* partial maxima */ max(1) -- of all partitions
+        ;
+    select * from agg_vals();
+$$ language plproxy;
+
+select * from agg_stats();
+select * from agg_vals();
+select agg_vals();
+select * from agg_max();
+
+-- no rows from any partition
+\c test_part0
+create function agg_none(out cnt int8, out total numeric) returns setof record as $$
+    select 1::int8, 1::numeric where false;
+$$ language sql;
+\c test_part1
+create function agg_none(out cnt int8, out total numeric) returns setof record as $$
+    select 1::int8, 1::numeric where false;
+$$ language sql;
+\c regression
+create function agg_none(out cnt int8, out total numeric) as $$
+    cluster 'aggcluster';
+    run on all;
+    aggregate count(cnt), sum(total);
+$$ language plproxy;
+select * from agg_none();
+
+-- errors
+create function agg_missing(out cnt int8, out total numeric, out last date, out name text) as $$
+    cluster 'aggcluster';
+    run on all;
+    aggregate sum(cnt);
+    select * from agg_stats();
+$$ language plproxy;
+create function agg_avg() returns setof int4 as $$
+    cluster 'aggcluster';
+    run on all;
+    aggregate avg(1);
+    select * from agg_vals();
+$$ language plproxy;
+create function agg_twice() returns setof int4 as $$
+    cluster 'aggcluster';
+    run on all;
+    aggregate sum(1), max(1);
+    select * from agg_vals();
+$$ language plproxy;
+create function agg_bad_pos() returns setof int4 as $$
+    cluster 'aggcluster';
+    run on all;
+    aggregate sum(0);
+$$ language plproxy;
+create function agg_limit() returns setof int4 as $$
+    cluster 'aggcluster';
+    run on all;
+    aggregate sum(1);
+    limit 1;
+$$ language plproxy;
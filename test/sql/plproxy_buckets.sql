@@ -0,0 +1,37 @@
+\set VERBOSITY terse
+set client_min_messages = 'warning';
+
+-- hash goes to bucket, bucket to partition
+create server bucketcluster foreign data wrapper plproxy
+    options (
+        partition_0 'dbname=test_part0 host=localhost',
+        partition_1 'dbname=test_part1 host=localhost',
+        partition_2 'dbname=test_part2 host=localhost',
+        buckets '0, 1, 2*2'
+    );
+create user mapping for public server bucketcluster;
+
+create function bucket_test(hash integer) returns text as $$
+    cluster 'bucketcluster';
+    run on hash;
+    select current_database()::text;
+$$ language plproxy;
+
+create function bucket_all() returns setof text as $$
+    cluster 'bucketcluster';
+    run on all;
+    select current_database()::text;
+$$ language plproxy;
+
+select h, bucket_test(h) from generate_series(0, 7) h;
+select * from bucket_all() order by 1;
+
+-- move one bucket
+alter server bucketcluster options (set buckets '0, 1, 2, 0');
+select h, bucket_test(h) from generate_series(0, 3) h;
+
+-- errors
+alter server bucketcluster options (set buckets '0, x');
+alter server bucketcluster options (set buckets '0, 1, 2');
+alter server bucketcluster options (set buckets '0, 1, 2, 3');
+alter server bucketcluster options (drop buckets);
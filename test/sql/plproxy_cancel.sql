@@ -22,3 +22,22 @@ select * from rsleep(10);
 -- test if works later
 select * from rsleep(0);
 
+
+-- millisecond query timeout
+reset statement_timeout;
+create server timeoutcluster foreign data wrapper plproxy
+    options (
+        partition_0 'dbname=test_part0 host=localhost',
+        query_timeout '200ms'
+    );
+create user mapping for public server timeoutcluster;
+create function rsleep_ms(val int4, out res int4) returns setof int4 as $$
+    cluster 'timeoutcluster';
+    target rsleep;
+    run on all;
+$$ language plproxy;
+select * from rsleep_ms(10);
+select * from rsleep_ms(0);
+
+-- invalid timeout value
+alter server timeoutcluster options (set query_timeout '200us');
@@ -0,0 +1,45 @@
+\set VERBOSITY terse
+set client_min_messages = 'warning';
+
+-- same lookup on all partitions, test_part0 is slow
+\c test_part0
+create function hedge_lookup(out dbname text) as $$
+begin
+    perform pg_sleep(2);
+    dbname := current_database();
+end; $$ language plpgsql;
+\c test_part1
+create function hedge_lookup(out dbname text) as $$
+begin
+    dbname := current_database();
+end; $$ language plpgsql;
+\c regression
+
+create server hedgecluster foreign data wrapper plproxy
+    options (
+        partition_0 'dbname=test_part0 host=localhost',
+        partition_1 'dbname=test_part1 host=localhost',
+        hedge_delay '100ms',
+        hedge_percentile '95'
+    );
+create user mapping for public server hedgecluster;
+
+create function hedge_lookup(out dbname text) as $$
+    cluster 'hedgecluster';
+    run on any;
+    readonly;
+$$ language plproxy;
+
+-- answer comes from fast partition, even if slow one was picked
+select hedge_lookup();
+select hedge_lookup();
+select hedge_lookup();
+select hedge_lookup();
+select hedge_lookup();
+
+-- invalid delay
+create server badhedge foreign data wrapper plproxy
+    options (
+        partition_0 'dbname=test_part0 host=localhost',
+        hedge_delay '100us'
+    );
@@ -0,0 +1,81 @@
+\set VERBOSITY terse
+set client_min_messages = 'warning';
+
+create server limitcluster foreign data wrapper plproxy
+    options (
+        partition_0 'dbname=test_part0 host=localhost',
+        partition_1 'dbname=test_part1 host=localhost'
+    );
+create user mapping for public server limitcluster;
+
+-- second partition is slow
+\c test_part0
+create function limit_vals() returns setof integer as $$
+    select generate_series(1, 3);
+$$ language sql;
+\c test_part1
+create function limit_vals() returns setof integer as $$
+begin
+    perform pg_sleep(1);
+    return query select generate_series(11, 13);
+end;
+$$ language plpgsql;
+\c regression
+
+create function limit_vals() returns setof integer as $$
+    cluster 'limitcluster';
+    run on all;
+    limit 2;
+$$ language plproxy;
+
+create function limit_vals_n(n int4) returns setof integer as $$
+    cluster 'limitcluster';
+    run on all;
+    limit n;
+    select * from limit_vals();
+$$ language plproxy;
+
+create function limit_top(n int8, out id integer, out label text) returns setof record as $$
+    cluster 'ordercluster';
+    run on all;
+    order by 1 desc;
+    limit n;
+    select * from order_rows_desc();
+$$ language plproxy;
+
+-- slow partition is cancelled
+select * from limit_vals();
+select * from limit_vals_n(1);
+select * from limit_vals_n(0);
+-- connections are usable after cancel
+select * from limit_vals();
+-- NULL means no limit
+select * from limit_vals_n(null);
+select * from limit_vals_n(-1);
+
+-- merge stops after limit
+select * from limit_top(2);
+select * from limit_top(3);
+
+-- errors
+create function limit_scalar() returns integer as $$
+    cluster 'limitcluster';
+    run on any;
+    limit 1;
+$$ language plproxy;
+create function limit_scalar_all() returns integer as $$
+    cluster 'limitcluster';
+    run on all;
+    limit 1;
+$$ language plproxy;
+create function limit_bad_arg(s text) returns setof integer as $$
+    cluster 'limitcluster';
+    run on all;
+    limit s;
+$$ language plproxy;
+create function limit_twice() returns setof integer as $$
+    cluster 'limitcluster';
+    run on all;
+    limit 1;
+    limit 2;
+$$ language plproxy;
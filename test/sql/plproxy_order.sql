@@ -0,0 +1,121 @@
+\set VERBOSITY terse
+set client_min_messages = 'warning';
+
+create server ordercluster foreign data wrapper plproxy
+    options (
+        partition_0 'dbname=test_part0 host=localhost',
+        partition_1 'dbname=test_part1 host=localhost'
+    );
+create user mapping for public server ordercluster;
+
+create server orderstream foreign data wrapper plproxy
+    options (
+        partition_0 'dbname=test_part0 host=localhost',
+        partition_1 'dbname=test_part1 host=localhost',
+        stream_chunk_size '1'
+    );
+create user mapping for public server orderstream;
+
+-- partitions return sorted rows
+\c test_part0
+create function order_rows(out id integer, out label text) returns setof record as $$
+    select * from (values (1, 'a'), (4, 'd'), (5, 'e')) v order by 1;
+$$ language sql;
+create function order_rows_desc(out id integer, out label text) returns setof record as $$
+    select * from (values (1, 'a'), (4, 'd'), (5, 'e')) v order by 1 desc;
+$$ language sql;
+create function order_vals() returns setof text as $$
+    select * from (values ('b'), ('c'), ('x')) v order by 1;
+$$ language sql;
+\c test_part1
+create function order_rows(out id integer, out label text) returns setof record as $$
+    select * from (values (2, 'b'), (3, 'c'), (6, 'f'), (null, 'z')) v order by 1;
+$$ language sql;
+create function order_rows_desc(out id integer, out label text) returns setof record as $$
+    select * from (values (2, 'b'), (3, 'c'), (6, 'f'), (null, 'z')) v order by 1 desc;
+$$ language sql;
+create function order_vals() returns setof text as $$
+    select * from (values ('a'), ('d')) v order by 1;
+$$ language sql;
+\c regression
+
+create function order_rows(out id integer, out label text) returns setof record as $$
+    cluster 'ordercluster';
+    run on all;
+    order by id;
+$$ language plproxy;
+
+create function order_rows_desc(out id integer, out label text) returns setof record as $$
+    cluster 'ordercluster';
+    run on all;
+    order by 1 desc;
+$$ language plproxy;
+
+create function order_vals() returns setof text as $$
+    cluster 'ordercluster';
+    run on all;
+    order by 1;
+$$ language plproxy;
+
+create function order_stream(out id integer, out label text) returns setof record as $$
+    cluster 'orderstream';
+    run on all;
+    order by ID asc;
+    select * from order_rows();
+$$ language plproxy;
+
+-- merged results
+select * from order_rows();
+select * from order_rows_desc();
+select * from order_vals();
+select order_vals();
+
+-- streaming merge
+select * from order_stream();
+select * from order_stream() limit 3;
+
+-- errors
+create function order_bad_dir(out id integer, out label text) returns setof record as $$
+    cluster 'ordercluster';
+    run on all;
+    order by id down;
+$$ language plproxy;
+
+create function order_bad_pos(out id integer, out label text) returns setof record as $$
+    cluster 'ordercluster';
+    run on all;
+    order by 0;
+$$ language plproxy;
+
+create function order_bad_col(out id integer, out label text) returns setof record as $$
+    cluster 'ordercluster';
+    run on all;
+    order by nope;
+    select * from order_rows();
+$$ language plproxy;
+
+create function order_bad_scalar() returns setof text as $$
+    cluster 'ordercluster';
+    run on all;
+    order by 2;
+    select * from order_vals();
+$$ language plproxy;
+
+-- newer keywords are plain names outside statement start
+create function order_kw_hash(range integer, readonly integer) returns text as $$
+    cluster 'ordercluster';
+    run on range;
+    select 'ok'::text;
+$$ language plproxy;
+select * from order_kw_hash(0, 0);
+
+create function order_kw_split("limit" integer[], partial integer, aggregate integer)
+returns setof text as $$
+    cluster 'ordercluster';
+    split limit;
+    run on partial;
+    readonly;
+    limit aggregate;
+    select 'ok'::text;
+$$ language plproxy;
+select * from order_kw_split(array[1, 2], 0, 5);
@@ -0,0 +1,73 @@
+\set VERBOSITY terse
+set client_min_messages = 'warning';
+
+-- test_part1 is slow or fails
+\c test_part0
+create function partial_slow(out dbname text) returns setof text as $$
+begin
+    return next current_database();
+end; $$ language plpgsql;
+create function partial_err(out dbname text) returns setof text as $$
+begin
+    return next current_database();
+end; $$ language plpgsql;
+\c test_part1
+create function partial_slow(out dbname text) returns setof text as $$
+begin
+    perform pg_sleep(2);
+    return next current_database();
+end; $$ language plpgsql;
+create function partial_err(out dbname text) returns setof text as $$
+begin
+    raise exception 'boom';
+end; $$ language plpgsql;
+\c regression
+
+create server partialcluster foreign data wrapper plproxy
+    options (
+        partition_0 'dbname=test_part0 host=localhost',
+        partition_1 'dbname=test_part1 host=localhost'
+    );
+create user mapping for public server partialcluster;
+
+create function partial_slow(out dbname text) returns setof text as $$
+    cluster 'partialcluster';
+    run on all;
+    partial '300ms';
+$$ language plproxy;
+
+create function partial_err(out dbname text) returns setof text as $$
+    cluster 'partialcluster';
+    run on all;
+    partial;
+$$ language plproxy;
+
+set client_min_messages = 'notice';
+
+-- slow partition is skipped after deadline
+select * from partial_slow();
+
+-- failing partition is skipped
+select * from partial_err();
+
+set client_min_messages = 'warning';
+
+-- errors
+create function partial_one(out dbname text) returns text as $$
+    cluster 'partialcluster';
+    run on any;
+    partial;
+$$ language plproxy;
+
+create function partial_bad(out dbname text) returns setof text as $$
+    cluster 'partialcluster';
+    run on all;
+    partial '1x';
+$$ language plproxy;
+
+create function partial_twice(out dbname text) returns setof text as $$
+    cluster 'partialcluster';
+    run on all;
+    partial;
+    partial '1s';
+$$ language plproxy;
@@ -0,0 +1,74 @@
+\set VERBOSITY terse
+set client_min_messages = 'warning';
+
+create server prepcluster foreign data wrapper plproxy
+    options (
+        partition_0 'dbname=test_part0 host=localhost',
+        prepared_statements '1'
+    );
+create user mapping for public server prepcluster;
+
+\c test_part0
+create or replace function prep_test(x integer) returns integer as $$
+begin
+    return x * 2;
+end; $$ language plpgsql;
+create or replace function prep_names() returns setof text as $$
+    select name::text from pg_prepared_statements
+     where statement not like '%prep_names%'
+     order by name;
+$$ language sql;
+create or replace function prep_rec(q text) returns setof record as $$
+declare
+    ret record;
+begin
+    for ret in execute q loop
+        return next ret;
+    end loop;
+end; $$ language plpgsql;
+\c regression
+
+create function prep_test(x integer) returns integer as $$
+    cluster 'prepcluster';
+    run on 0;
+$$ language plproxy;
+create function prep_names() returns setof text as $$
+    cluster 'prepcluster';
+    run on 0;
+$$ language plproxy;
+
+-- statement is prepared once and reused
+select prep_test(1);
+select prep_test(2);
+select prep_names();
+
+-- redefining function drops its remote statement
+create or replace function prep_test(x integer) returns integer as $$
+    cluster 'prepcluster';
+    run on any;
+$$ language plproxy;
+select prep_test(3);
+select prep_names();
+
+-- statements of other functions are kept
+create function prep_test2(x integer) returns integer as $$
+    cluster 'prepcluster';
+    run on 0;
+    select prep_test(x) + 1;
+$$ language plproxy;
+select prep_test2(1);
+create or replace function prep_test(x integer) returns integer as $$
+    cluster 'prepcluster';
+    run on 0;
+$$ language plproxy;
+select prep_test(4);
+select prep_names();
+
+-- new column list replaces statement of same function
+create function prep_rec(q text) returns setof record as $$
+    cluster 'prepcluster';
+    run on 0;
+$$ language plproxy;
+select * from prep_rec('select 1') as (a integer);
+select * from prep_rec('select 1, 2') as (a integer, b integer);
+select prep_names();
@@ -0,0 +1,40 @@
+\set VERBOSITY terse
+set client_min_messages = 'warning';
+
+create server prewarmcluster foreign data wrapper plproxy
+    options (
+        partition_0 'dbname=test_part0 host=localhost',
+        partition_1 'dbname=test_part1 host=localhost',
+        partition_2 'dbname=test_part2 host=localhost',
+        partition_3 'dbname=test_part0 host=localhost'
+    );
+create user mapping for public server prewarmcluster;
+
+create function prewarm_db() returns setof text as $$
+    cluster 'prewarmcluster';
+    run on all;
+    select current_database()::text;
+$$ language plproxy;
+
+-- new connections, partitions 0 and 3 share one
+select part_nr, reused, connect_ms >= 0 as timed from plproxy_prewarm('prewarmcluster');
+
+-- open connections are reused
+select part_nr, reused, connect_ms from plproxy_prewarm('prewarmcluster');
+select * from prewarm_db() order by 1;
+select part_nr, reused from plproxy_prewarm('prewarmcluster');
+
+-- tuning with prepared statements, prewarm has no query to prepare
+create server prewarmprep foreign data wrapper plproxy
+    options (
+        partition_0 'dbname=test_part0 host=localhost',
+        partition_1 'dbname=test_part1 host=localhost',
+        prepared_statements '1'
+    );
+create user mapping for public server prewarmprep;
+select part_nr, reused from plproxy_prewarm('prewarmprep');
+select part_nr, reused from plproxy_prewarm('prewarmprep');
+
+-- errors
+select * from plproxy_prewarm('nonexists');
+select * from plproxy_prewarm(null);
@@ -0,0 +1,66 @@
+\set VERBOSITY terse
+set client_min_messages = 'warning';
+
+create server replicacluster foreign data wrapper plproxy
+    options (
+        partition_0 'dbname=test_part0 host=localhost',
+        p0_replica 'dbname=test_part1 host=localhost',
+        partition_0_replica_2 'dbname=test_part2 host=localhost'
+    );
+create user mapping for public server replicacluster;
+
+create function replica_db() returns text as $$
+    cluster 'replicacluster';
+    run on 0;
+    readonly;
+    select current_database()::text;
+$$ language plproxy;
+
+create function primary_db() returns text as $$
+    cluster 'replicacluster';
+    run on 0;
+    select current_database()::text;
+$$ language plproxy;
+
+-- readonly calls go round the replicas
+select array_agg(db order by db) from (select replica_db() as db from generate_series(1, 3)) s;
+
+-- others use primary
+select array_agg(db order by db) from (select primary_db() as db from generate_series(1, 3)) s;
+
+-- pick by latency
+alter server replicacluster options (add replica_selection 'least_latency');
+select count(db) from (select replica_db() as db from generate_series(1, 5)) s;
+
+-- errors
+create function replica_twice() returns text as $$
+    cluster 'replicacluster';
+    readonly;
+    readonly;
+$$ language plproxy;
+alter server replicacluster options (add p1_replica 'dbname=test_part3 host=localhost');
+alter server replicacluster options (set replica_selection 'fastest');
+
+-- config function: only columns named replica* are replicas
+begin;
+create or replace function plproxy.get_cluster_version(cluster_name text)
+returns integer as $$ begin return 1; end; $$ language plpgsql;
+create or replace function plproxy.get_cluster_config(cluster_name text, out key text, out val text)
+returns setof record as $$ begin return; end; $$ language plpgsql;
+drop function plproxy.get_cluster_partitions(text);
+create function plproxy.get_cluster_partitions(cluster_name text,
+    out connstr text, out weight integer, out replica text)
+returns setof record as $$ begin
+    connstr := 'dbname=test_part0 host=localhost';
+    weight := 1;
+    replica := 'dbname=test_part1 host=localhost';
+    return next;
+end; $$ language plpgsql;
+create function replmap_db() returns text as $$
+    cluster 'replmap';
+    run on 0;
+    readonly;
+    select current_database()::text;
+$$ language plproxy;
+select array_agg(db order by db) from (select replmap_db() as db from generate_series(1, 2)) s;
+rollback;
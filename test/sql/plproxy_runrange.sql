@@ -0,0 +1,59 @@
+\set VERBOSITY terse
+set client_min_messages = 'warning';
+
+-- partition N holds keys from bound N-1 up to bound N
+create server rangecluster foreign data wrapper plproxy
+    options (
+        partition_0 'dbname=test_part0 host=localhost',
+        partition_1 'dbname=test_part1 host=localhost',
+        partition_2 'dbname=test_part2 host=localhost',
+        partition_3 'dbname=test_part3 host=localhost',
+        range_bounds '100, 200, 300'
+    );
+create user mapping for public server rangecluster;
+
+create function range_test(id integer) returns text as $$
+    cluster 'rangecluster';
+    run on range id;
+    select current_database()::text;
+$$ language plproxy;
+
+select id, range_test(id) from unnest(array[-1, 5, 99, 100, 150, 200, 299, 1000]) id;
+select range_test(null);
+
+-- bounds are decoded with key type
+create function range_date(d date) returns text as $$
+    cluster 'rangecluster';
+    run on range $1;
+    select current_database()::text;
+$$ language plproxy;
+
+alter server rangecluster options (set range_bounds '2020-01-01, 2021-01-01, 2022-01-01');
+select range_date('2019-12-31') as d1, range_date('2020-01-01') as d2,
+       range_date('2020-06-30') as d3, range_date('2021-01-01') as d4;
+
+-- rows of split array go to their partitions
+alter server rangecluster options (set range_bounds '100, 200, 300');
+create function range_split(ids integer[]) returns setof text as $$
+    cluster 'rangecluster';
+    split ids;
+    run on range ids;
+    select current_database()::text || ':' || array_to_string(ids, ',');
+$$ language plproxy;
+
+select * from range_split(array[1, 150, 250, 2, 199, 350]) order by 1;
+
+-- errors
+alter server rangecluster options (set range_bounds '100');
+alter server rangecluster options (set range_bounds '100, 300, 200');
+select range_test(5);
+alter server rangecluster options (set range_bounds '100, 200, 300');
+
+-- hash functions may use same cluster, partition count stays power of 2
+alter server rangecluster options (drop partition_3, set range_bounds '100, 200');
+
+create function range_badarg(id integer) returns text as $$
+    cluster 'rangecluster';
+    run on range foo;
+    select current_database()::text;
+$$ language plproxy;
@@ -114,11 +114,17 @@ $$ LANGUAGE plproxy;
 select * from test3(NULL,NULL, 'a');
 select * from test3('a', NULL,NULL);
 
-
-
-
-
-
-
-
-
+-- custom SELECT may return other types than function, they go through text
+create function get_wide(x int4) returns int8 as $$
+    cluster 'testcluster';
+    run on 0;
+    select x + 1;
+$$ language plproxy;
+create type wide_type as (num int8, val float8);
+create function get_wide_rec(x int4) returns setof wide_type as $$
+    cluster 'testcluster';
+    run on 0;
+    select x as num, 1.5::float4 as val;
+$$ language plproxy;
+select get_wide(1);
+select * from get_wide_rec(2);
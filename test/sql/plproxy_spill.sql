@@ -0,0 +1,66 @@
+\set VERBOSITY terse
+set client_min_messages = 'warning';
+
+-- rows over result_memory_limit go to disk while receiving
+\c test_part0
+create function spill_rows(n integer, out id integer, out data text)
+returns setof record as $$
+    select i, repeat('x', 100) from generate_series(1, n) i;
+$$ language sql;
+create function spill_ids(n integer) returns setof integer as $$
+    select case when i % 10 = 0 then null else i end from generate_series(1, n) i;
+$$ language sql;
+create function spill_fail(n integer) returns setof integer as $$
+    select generate_series(1, n);
+$$ language sql;
+\c test_part1
+create function spill_rows(n integer, out id integer, out data text)
+returns setof record as $$
+    select i, repeat('x', 100) from generate_series(1, n) i;
+$$ language sql;
+create function spill_ids(n integer) returns setof integer as $$
+    select case when i % 10 = 0 then null else i end from generate_series(1, n) i;
+$$ language sql;
+create function spill_fail(n integer) returns setof integer as $$
+begin
+    return query select generate_series(1, n);
+    raise exception 'boom';
+end; $$ language plpgsql;
+\c regression
+
+create server spillcluster foreign data wrapper plproxy
+    options (
+        partition_0 'dbname=test_part0 host=localhost',
+        partition_1 'dbname=test_part1 host=localhost',
+        result_memory_limit '64'
+    );
+create user mapping for public server spillcluster;
+
+create function spill_rows(n integer, out id integer, out data text)
+returns setof record as $$
+    cluster 'spillcluster';
+    run on all;
+$$ language plproxy;
+create function spill_ids(n integer) returns setof integer as $$
+    cluster 'spillcluster';
+    run on all;
+$$ language plproxy;
+create function spill_fail(n integer) returns setof integer as $$
+    cluster 'spillcluster';
+    run on all;
+$$ language plproxy;
+
+-- composite rows
+select count(*), count(distinct id), sum(length(data)) from spill_rows(20000);
+select id, length(data) from spill_rows(2) order by id;
+
+-- scalar rows with NULLs
+select count(*), count(s), sum(s) from spill_ids(10000) s;
+select * from spill_ids(3) s order by 1;
+
+-- remote error drops stored rows, cluster stays usable
+select count(*) from spill_fail(5000);
+select count(*) from spill_ids(3);
+
+-- set-returning function in select list
+select count(*) from (select spill_ids(10000)) s;
@@ -83,6 +83,19 @@ set session authorization test_user_bob;
 select * from sqlmed_test_charlie();
 reset session authorization;
 
+-- directly called hash function checks EXECUTE for current user
+create function sqlmed_hash(text) returns integer as 'hashtext' language internal immutable strict;
+revoke execute on function sqlmed_hash(text) from public;
+create function sqlmed_hash_test(key text) returns text as $$
+    cluster 'sqlmedcluster';
+    run on sqlmed_hash(key);
+    select 'ok'::text;
+$$ language plproxy;
+select * from sqlmed_hash_test('a');
+set session authorization test_user_bob;
+select * from sqlmed_hash_test('a');
+reset session authorization;
+
 
 -- cluster definition validation
 
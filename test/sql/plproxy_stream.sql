@@ -0,0 +1,63 @@
+\set VERBOSITY terse
+set client_min_messages = 'warning';
+
+create server streamcluster foreign data wrapper plproxy
+    options (
+        partition_0 'dbname=test_part0 host=localhost',
+        partition_1 'dbname=test_part1 host=localhost',
+        stream_chunk_size '2'
+    );
+create user mapping for public server streamcluster;
+
+\c test_part0
+create or replace function stream_rows(n integer, out id integer, out dbname text)
+returns setof record as $$
+    select i, current_database()::text from generate_series(1, n) i;
+$$ language sql;
+\c test_part1
+create or replace function stream_rows(n integer, out id integer, out dbname text)
+returns setof record as $$
+    select i, current_database()::text from generate_series(1, n) i;
+$$ language sql;
+\c regression
+
+create function stream_rows(n integer, out id integer, out dbname text)
+returns setof record as $$
+    cluster 'streamcluster';
+    run on all;
+$$ language plproxy;
+
+-- rows from all partitions
+select * from stream_rows(5) order by dbname, id;
+select count(*) from stream_rows(1000);
+
+-- stop reading early, remote queries are canceled
+select count(*) from (select stream_rows(100000) limit 3) s;
+select count(*) from stream_rows(3);
+
+-- error while streaming frees the cluster
+select r.id / (r.id - 2) from (select (stream_rows(3)).id) r;
+select count(*) from stream_rows(3);
+
+-- nested call to same cluster is not allowed
+select (select count(*) from stream_rows(r.id)) from (select (stream_rows(2)).id) r;
+select count(*) from stream_rows(3);
+
+-- rows are returned in arrival order, slow partition does not hold back others
+\c test_part0
+create function stream_slow(out id integer, out dbname text) returns setof record as $$
+begin
+    perform pg_sleep(1);
+    return query select 1, current_database()::text;
+end;
+$$ language plpgsql;
+\c test_part1
+create function stream_slow(out id integer, out dbname text) returns setof record as $$
+    select 2, current_database()::text;
+$$ language sql;
+\c regression
+create function stream_slow(out id integer, out dbname text) returns setof record as $$
+    cluster 'streamcluster';
+    run on all;
+$$ language plproxy;
+select * from stream_slow();
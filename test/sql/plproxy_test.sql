@@ -143,6 +143,21 @@ as $$ begin return; end; $$ language plpgsql;
 select * from test_types2('types', 4, (2, 'asd'), array[1,2,3]);
 select * from test_types2('types', NULL, NULL, NULL);
 
+-- test types with fast I/O
+create function test_types3(username text, inout v2 int2, inout v4 int4, inout v8 int8,
+                            inout vo oid, inout vf float8, inout vb bool, inout vu uuid)
+as $$ cluster 'testcluster'; $$ language plproxy;
+\c test_part
+create function test_types3(username text, inout v2 int2, inout v4 int4, inout v8 int8,
+                            inout vo oid, inout vf float8, inout vb bool, inout vu uuid)
+as $$ begin return; end; $$ language plpgsql;
+\c regression
+select * from test_types3('types', '-32768', '-2147483648', '-9223372036854775808',
+                          '4294967295', '1.5e300', true, 'A0EEBC99-9C0B-4EF8-BB6D-6BB9BD380A11');
+select * from test_types3('types', '12', '345', '6789012345', '0', '-0.25', false,
+                          '00000000-0000-0000-0000-000000000000');
+select * from test_types3('types', NULL, NULL, NULL, NULL, NULL, NULL, NULL);
+
 -- test CONNECT
 create function test_connect1() returns text
 as $$ connect 'dbname=test_part'; select current_database(); $$ language plproxy;